@@ -1,21 +1,84 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bitmap.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BITMAP_AVX2 1
+#endif
+
 // get the types right
 #define bitmap_one        (bitmap_type)1
+#define bitmap_full       (~(bitmap_type)0)
+
+// Words checked at once by the AVX2 scan.
+#define bitmap_lane_words (256 / bitmap_wordlength)
+
+#define bitmap_words(bits) (((bits) + bitmap_wordlength - 1) / bitmap_wordlength)
+
+/**
+ * The bits of a level's @word that lie past the end of the level, so a word can count as full without them.
+ */
+static bitmap_type padding(int bits, int word) {
+    int used = bits - (word << bitmap_shift);
+    return used >= bitmap_wordlength ? 0 : bitmap_full << used;
+}
+
+static int word_full(BitMap *map, int level, int word) {
+    return (map->levels[level][word] | padding(map->levelBits[level], word)) == bitmap_full;
+}
+
+/**
+ * Raises the dirty flag of the chunk holding @word, when changes are tracked.
+ */
+static void mark_dirty(BitMap *map, int word) {
+    if (map->dirtyChunks) {
+        __atomic_store_n(&map->dirtyChunks[(map->wordOffset + word) / map->chunkWords], 1, __ATOMIC_RELEASE);
+    }
+}
 
 void bitmap_set(BitMap *map, int position) {
     int word = position >> bitmap_shift;
     int shift = position & bitmap_mask;
     map->container[word] |= bitmap_one << shift;
+    mark_dirty(map, word);
+
+    if (position == map->lowestFree) {
+        map->lowestFree++;
+    }
+
+    // Filling a word fills it's bit one level up, which may fill that word too.
+    int level = 1;
+    for (; level < map->numLevels && word_full(map, level - 1, word); level++) {
+        map->levels[level][word >> bitmap_shift] |= bitmap_one << (word & bitmap_mask);
+        word >>= bitmap_shift;
+    }
 }
 
 void bitmap_clear(BitMap *map, int position) {
     int word = position >> bitmap_shift;
     int shift = position & bitmap_mask;
-    map->container[word] &= ~(bitmap_one << shift);
+
+    if (position < map->lowestFree) {
+        map->lowestFree = position;
+    }
+
+    int level = 0;
+    for (; level < map->numLevels; level++) {
+        int full = word_full(map, level, word);
+        map->levels[level][word] &= ~(bitmap_one << shift);
+
+        if (!full) {
+            break; // The levels above never counted this word as full.
+        }
+
+        shift = word & bitmap_mask;
+        word >>= bitmap_shift;
+    }
+
+    mark_dirty(map, position >> bitmap_shift);
 }
 
 int bitmap_get(BitMap *map, int position) {
@@ -24,6 +87,35 @@ int bitmap_get(BitMap *map, int position) {
     return (map->container[word] >> shift) & bitmap_one;
 }
 
+/**
+ * Stacks summary levels over the container until the top one fits in BITMAP_TOP_WORDS words.
+ * @return 0 on success, -1 if a level couldn't be allocated.
+ */
+static int allocate_levels(BitMap *map) {
+    map->cursor = 0;
+    map->lowestFree = 0;
+
+    map->numLevels = 1;
+    map->levelBits[0] = map->bits;
+    map->levels[0] = map->container;
+
+    int words = map->numPartitions;
+    while (words > BITMAP_TOP_WORDS && map->numLevels < BITMAP_MAX_LEVELS) {
+        bitmap_type *level = (bitmap_type *) calloc((size_t) bitmap_words(words), sizeof(bitmap_type));
+        if (!level) {
+            return -1;
+        }
+
+        map->levelBits[map->numLevels] = words;
+        map->levels[map->numLevels] = level;
+        map->numLevels++;
+
+        words = bitmap_words(words);
+    }
+
+    return 0;
+}
+
 BitMap *bitmap_allocate(int bits) {
     BitMap *map = (BitMap *) malloc(sizeof(BitMap));
     if (!map) {
@@ -31,7 +123,11 @@ BitMap *bitmap_allocate(int bits) {
     }
 
     map->bits = bits;
-    map->numPartitions = (bits + bitmap_wordlength - 1) / bitmap_wordlength;
+    map->numPartitions = bitmap_words(bits);
+    map->ownsContainer = 1;
+    map->dirtyChunks = NULL;
+    map->chunkWords = 1;
+    map->wordOffset = 0;
 
     fprintf(stderr, "Partitions: %d\n", map->numPartitions);
 
@@ -39,18 +135,304 @@ BitMap *bitmap_allocate(int bits) {
     if (!map->container)
         return NULL;
 
+    if (allocate_levels(map) < 0) {
+        bitmap_deallocate(map);
+        return NULL;
+    }
+
     return map;
 }
 
+BitMap *bitmap_slice(BitMap *map, int first, int bits) {
+    if ((first & bitmap_mask) != 0 || first < 0 || first + bits > map->bits) {
+        return NULL;
+    }
+
+    BitMap *slice = (BitMap *) malloc(sizeof(BitMap));
+    if (!slice) {
+        return NULL;
+    }
+
+    slice->bits = bits;
+    slice->numPartitions = bitmap_words(bits);
+    slice->container = map->container + (first >> bitmap_shift);
+    slice->ownsContainer = 0;
+    slice->dirtyChunks = map->dirtyChunks;
+    slice->chunkWords = map->chunkWords;
+    slice->wordOffset = map->wordOffset + (first >> bitmap_shift);
+
+    if (allocate_levels(slice) < 0) {
+        bitmap_deallocate(slice);
+        return NULL;
+    }
+
+    bitmap_rebuild(slice);
+    return slice;
+}
+
 void bitmap_deallocate(BitMap *map) {
-    free(map->container);
+    int level = 1;
+    for (; level < map->numLevels; level++) {
+        free(map->levels[level]);
+    }
+
+    if (map->ownsContainer) {
+        free(map->container);
+        free(map->dirtyChunks);
+    }
     free(map);
 }
 
+int bitmap_grow(BitMap *map, int bits) {
+    if (bits <= map->bits) {
+        return 0;
+    }
+
+    if (!map->ownsContainer) {
+        return -1;
+    }
+
+    BitMap *grown = bitmap_allocate(bits);
+    if (!grown) {
+        return -1;
+    }
+
+    memcpy(grown->container, map->container, sizeof(bitmap_type) * map->numPartitions);
+
+    if (map->dirtyChunks) {
+        if (bitmap_track_dirty(grown, map->chunkWords, 1) < 0) {
+            bitmap_deallocate(grown);
+            return -1;
+        }
+
+        memcpy(grown->dirtyChunks, map->dirtyChunks, (size_t) bitmap_num_chunks(map));
+
+        // The chunk that was cut short gained words too.
+        grown->dirtyChunks[bitmap_num_chunks(map) - 1] = 1;
+    }
+
+    bitmap_rebuild(grown);
+
+    // Swap the contents, so pointers to @map stay good.
+    BitMap old = *map;
+    *map = *grown;
+    *grown = old;
+    bitmap_deallocate(grown);
+
+    return 0;
+}
+
+int bitmap_track_dirty(BitMap *map, int chunkWords, int dirty) {
+    if (chunkWords <= 0) {
+        return -1;
+    }
+
+    free(map->dirtyChunks);
+    map->chunkWords = chunkWords;
+    map->dirtyChunks = (unsigned char *) malloc((size_t) bitmap_num_chunks(map));
+    if (!map->dirtyChunks) {
+        return -1;
+    }
+
+    memset(map->dirtyChunks, dirty ? 1 : 0, (size_t) bitmap_num_chunks(map));
+    return 0;
+}
+
+int bitmap_num_chunks(BitMap *map) {
+    return (map->wordOffset + map->numPartitions + map->chunkWords - 1) / map->chunkWords;
+}
+
+int bitmap_take_dirty(BitMap *map, int chunk) {
+    return map->dirtyChunks && __atomic_exchange_n(&map->dirtyChunks[chunk], 0, __ATOMIC_ACQ_REL);
+}
+
+void bitmap_rebuild(BitMap *map) {
+    map->cursor = 0;
+    map->lowestFree = 0;
+
+    int level = 1;
+    for (; level < map->numLevels; level++) {
+        memset(map->levels[level], 0, sizeof(bitmap_type) * bitmap_words(map->levelBits[level]));
+
+        int word = 0;
+        for (; word < map->levelBits[level]; word++) {
+            if (word_full(map, level - 1, word)) {
+                map->levels[level][word >> bitmap_shift] |= bitmap_one << (word & bitmap_mask);
+            }
+        }
+    }
+}
+
+int bitmap_count_set(BitMap *map) {
+    int count = 0;
+
+    int word = 0;
+    for (; word < map->numPartitions; word++) {
+        bitmap_type value = map->container[word] & ~padding(map->bits, word);
+        count += __builtin_popcountll((unsigned long long) value);
+    }
+
+    return count;
+}
+
 void bitmap_print(BitMap *map) {
     int index = 0;
     for (; index < map->numPartitions; index++) {
         printf(" " bitmap_fmt, map->container[index]);
     }
     printf("\n");
+}
+
+size_t bitmap_bytes(BitMap *map) {
+    size_t bytes = sizeof(BitMap);
+
+    int level = 0;
+    for (; level < map->numLevels; level++) {
+        bytes += sizeof(bitmap_type) * bitmap_words(map->levelBits[level]);
+    }
+
+    return bytes;
+}
+
+#ifdef BITMAP_AVX2
+/**
+ * Skips whole 256 bit lanes that are all ones.
+ * @return The first word from @word on that isn't full, or the end of the last whole lane checked.
+ */
+__attribute__((target("avx2")))
+static int skip_full_lanes(const bitmap_type *container, int word, int numPartitions) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+
+    for (; word + bitmap_lane_words <= numPartitions; word += bitmap_lane_words) {
+        __m256i lane = _mm256_loadu_si256((const __m256i *) (container + word));
+        if (!_mm256_testc_si256(lane, ones)) {
+            break;
+        }
+    }
+
+    return word;
+}
+#endif
+
+/**
+ * Finds the first clear bit of a level at or after @start. The top level is scanned a word (or a lane) at a time,
+ * every level below asks the level above which of it's words has room.
+ */
+static int level_find_zero(BitMap *map, int level, int start) {
+    int bits = map->levelBits[level];
+    if (start >= bits) {
+        return -1;
+    }
+
+    bitmap_type *words = map->levels[level];
+    int numWords = bitmap_words(bits);
+    int word = start >> bitmap_shift;
+
+    // Pretend the bits before @start are taken.
+    bitmap_type value = words[word] | ((bitmap_one << (start & bitmap_mask)) - 1) | padding(bits, word);
+
+    if (value == bitmap_full && level + 1 < map->numLevels) {
+        word = level_find_zero(map, level + 1, word + 1);
+        if (word < 0) {
+            return -1;
+        }
+
+        value = words[word] | padding(bits, word);
+    }
+
+#ifdef BITMAP_AVX2
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+#endif
+
+    while (value == bitmap_full) {
+        if (++word >= numWords) {
+            return -1;
+        }
+
+#ifdef BITMAP_AVX2
+        if (avx2) {
+            word = skip_full_lanes(words, word, numWords);
+            if (word >= numWords) {
+                return -1; // Every lane left was full.
+            }
+        }
+#endif
+
+        value = words[word] | padding(bits, word);
+    }
+
+    int position = (word << bitmap_shift) + __builtin_ctzll((unsigned long long) ~value);
+    return position < bits ? position : -1; // The tail of the last word is padding.
+}
+
+int bitmap_find_first_zero(BitMap *map, int start) {
+    return level_find_zero(map, 0, start < 0 ? 0 : start);
+}
+
+int bitmap_next_free(BitMap *map) {
+    int position = bitmap_find_first_zero(map, map->cursor);
+    if (position == -1 && map->lowestFree < map->cursor) {
+        position = bitmap_find_first_zero(map, map->lowestFree);
+    }
+
+    if (position == -1) {
+        map->lowestFree = map->bits; // Nothing is free until something is cleared.
+        return -1;
+    }
+
+    if (position < map->cursor) {
+        map->lowestFree = position; // Wrapped, so everything before it is taken.
+    }
+
+    map->cursor = position + 1 < map->bits ? position + 1 : 0;
+    return position;
+}
+
+/**
+ * Finds the first set bit in [@start, @end), word at a time.
+ * @return The position of the bit, @end if there is none.
+ */
+static int find_first_one(BitMap *map, int start, int end) {
+    int word = start >> bitmap_shift;
+    bitmap_type value = map->container[word] & (bitmap_full << (start & bitmap_mask));
+
+    while (!value) {
+        if (++word << bitmap_shift >= end) {
+            return end;
+        }
+
+        value = map->container[word];
+    }
+
+    int position = (word << bitmap_shift) + __builtin_ctzll((unsigned long long) value);
+    return position < end ? position : end;
+}
+
+int bitmap_find_first_one(BitMap *map, int start) {
+    return start < map->bits ? find_first_one(map, start, map->bits) : map->bits;
+}
+
+int bitmap_find_zero_run(BitMap *map, int start, int length) {
+    if (length <= 0) {
+        return -1;
+    }
+
+    int position = bitmap_find_first_zero(map, start);
+    while (position >= 0) {
+        if (position + length > map->bits) {
+            return -1;
+        }
+
+        int end = find_first_one(map, position, position + length);
+        if (end == position + length) {
+            return position;
+        }
+
+        position = bitmap_find_first_zero(map, end);
+    }
+
+    return -1;
 }
\ No newline at end of file
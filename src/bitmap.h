@@ -5,6 +5,8 @@
 #ifndef ASSIGNMENT3_BITMAP_H
 #define ASSIGNMENT3_BITMAP_H
 
+#include <stddef.h>
+
 #ifdef bitmap_64
 #define bitmap_type unsigned long long int
 #define bitmap_shift        6
@@ -19,9 +21,48 @@
 #define bitmap_fmt "%08x"
 #endif
 
+/**
+ * The most summary levels a bit map can have, enough for any int sized bit map.
+ */
+#define BITMAP_MAX_LEVELS 8
+
+/**
+ * Levels stop being added once a level fits in this many words, the top level is scanned flat.
+ */
+#define BITMAP_TOP_WORDS 32
+
 typedef struct {
     int bits, numPartitions;
     bitmap_type *container;
+
+    /**
+     * Level 0 is the container itself, every level above holds one bit per word below it, set while that word is full.
+     */
+    int numLevels;
+    int levelBits[BITMAP_MAX_LEVELS];
+    bitmap_type *levels[BITMAP_MAX_LEVELS];
+
+    /**
+     * Where the next search starts, right after the last bit handed out.
+     */
+    int cursor;
+
+    /**
+     * No bit below this one is clear, so wrapping around past the end resumes here instead of at 0.
+     */
+    int lowestFree;
+
+    /**
+     * Whether the container belongs to this bit map, slices borrow theirs from the bit map they were cut from.
+     */
+    int ownsContainer;
+
+    /**
+     * One flag per chunk of @chunkWords words, raised when a bit in the chunk changes, NULL while untracked.
+     * Slices share the flags of the bit map they were cut from and start @wordOffset words into it.
+     */
+    unsigned char *dirtyChunks;
+    int chunkWords, wordOffset;
 } BitMap;
 
 void bitmap_set(BitMap *map, int position);
@@ -32,8 +73,81 @@ int bitmap_get(BitMap *map, int position);
 
 BitMap *bitmap_allocate(int bits);
 
+/**
+ * Cuts a slice of @bits bits out of @map, starting at @first which must fall on a word boundary. The slice shares
+ * @map's words but has it's own summary levels and cursor, so once a bit map is sliced it should only be changed
+ * through it's slices.
+ * @return The slice, NULL if it couldn't be allocated.
+ */
+BitMap *bitmap_slice(BitMap *map, int first, int bits);
+
 void bitmap_deallocate(BitMap *map);
 
+/**
+ * Grows a bit map that owns it's container to @bits bits, the new bits clear. Changes stay tracked and the new chunks
+ * start out dirty, the cursor starts over. Slices can't grow.
+ * @return 0 on success, -1 if it's a slice or the memory couldn't be had, leaving the bit map as it was.
+ */
+int bitmap_grow(BitMap *map, int bits);
+
+/**
+ * Starts tracking which chunks of @chunkWords words were changed by bitmap_set and bitmap_clear, every chunk starts
+ * out as @dirty. Slices cut afterwards share the tracking.
+ * @return 0 on success, -1 if the flags couldn't be allocated.
+ */
+int bitmap_track_dirty(BitMap *map, int chunkWords, int dirty);
+
+/**
+ * Returns the number of chunks a tracked bit map is split into.
+ */
+int bitmap_num_chunks(BitMap *map);
+
+/**
+ * Clears a chunk's dirty flag, take it before copying the chunk's words so no change slips by unwritten.
+ * @return Whether the chunk was dirty.
+ */
+int bitmap_take_dirty(BitMap *map, int chunk);
+
+/**
+ * Finds the first clear bit at or after @start, a whole word at a time.
+ * @return The position of the bit, -1 if every bit from @start on is set.
+ */
+int bitmap_find_first_zero(BitMap *map, int start);
+
+/**
+ * Finds the first set bit at or after @start.
+ * @return The position of the bit, the number of bits if none is set.
+ */
+int bitmap_find_first_one(BitMap *map, int start);
+
+/**
+ * Finds a clear bit next-fit: from the cursor to the end, then wrapping around to the lowest freed bit.
+ * The cursor moves past the bit found.
+ * @return The position of the bit, -1 if the bit map is full.
+ */
+int bitmap_next_free(BitMap *map);
+
+/**
+ * Finds the first run of @length clear bits at or after @start.
+ * @return The position the run starts at, -1 if there is no such run.
+ */
+int bitmap_find_zero_run(BitMap *map, int start, int length);
+
+/**
+ * Counts the set bits, a word at a time with popcount.
+ */
+int bitmap_count_set(BitMap *map);
+
+/**
+ * Recomputes the summary levels and resets the cursor, for after the container was filled in directly.
+ */
+void bitmap_rebuild(BitMap *map);
+
 void bitmap_print(BitMap *map);
 
+/**
+ * Returns the memory the bit map's words and summary levels take up, in bytes.
+ */
+size_t bitmap_bytes(BitMap *map);
+
 #endif //ASSIGNMENT3_BITMAP_H
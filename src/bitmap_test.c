@@ -0,0 +1,65 @@
+#include <stdio.h>
+
+#include "bitmap.h"
+
+/**
+ * Regression checks for the free bit searches on completely full maps, the ENOSPC path. The sizes give word counts
+ * that are whole multiples of the 256 bit lane, with and without summary levels above the container, and the searches
+ * start from every word, so the lane scan runs right up to the end of the level it searches.
+ *
+ * usage: bitmap_test
+ */
+
+static int failures = 0;
+
+static void expect(int got, int wanted, const char *what, int bits) {
+    if (got != wanted) {
+        fprintf(stderr, "%s on %d bits: got %d, wanted %d\n", what, bits, got, wanted);
+        failures++;
+    }
+}
+
+static void check_full(int bits) {
+    BitMap *map = bitmap_allocate(bits);
+    if (!map) {
+        fprintf(stderr, "Could not allocate a bit map of %d bits.\n", bits);
+        failures++;
+        return;
+    }
+
+    int position = 0;
+    for (; position < bits; position++) {
+        bitmap_set(map, position);
+    }
+
+    // From every word, so the lanes scanned after it end exactly at the end of the map for some of them.
+    for (position = 0; position < bits; position += bitmap_wordlength) {
+        expect(bitmap_find_first_zero(map, position), -1, "bitmap_find_first_zero", bits);
+    }
+
+    expect(bitmap_next_free(map), -1, "bitmap_next_free", bits);
+    expect(bitmap_find_zero_run(map, 0, 1), -1, "bitmap_find_zero_run", bits);
+
+    // Freeing the very last bit has to be found behind all the full lanes.
+    bitmap_clear(map, bits - 1);
+    expect(bitmap_find_first_zero(map, 0), bits - 1, "bitmap_find_first_zero of the last bit", bits);
+
+    bitmap_deallocate(map);
+}
+
+int main() {
+    int lane = 256; // Bits in one AVX2 lane.
+
+    check_full(lane);                // One lane, no summary levels.
+    check_full(lane * 4);            // Several lanes, no summary levels.
+    check_full(lane * 32);           // One summary level, it's top a whole lane.
+    check_full(lane * 1024);         // Two summary levels, the top a whole lane.
+    check_full(lane * 4 + 1);        // A word of padding past the last lane.
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed.\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -5,18 +5,175 @@
   See the file COPYING.
 */
 
+#define _GNU_SOURCE // O_DIRECT
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "block.h"
+#include "cache.h"
+#include "pool.h"
+#include "uring.h"
+
+/**
+ * The most blocks moved by a single transfer.
+ */
+#define MAX_RUN_BLOCKS 256
+
+/**
+ * Address space reserved for mapping the disk file, the file can grow up to this within the mapping.
+ */
+#define MAP_WINDOW_BYTES (1L << 30)
+
+/**
+ * Aligned buffers kept around to stage blocks for O_DIRECT transfers.
+ */
+#define DIRECT_POOL_BUFFERS 64
+
+/**
+ * The strictest memory alignment O_DIRECT asks for, blocks smaller than this only need their own size.
+ */
+#define DIRECT_ALIGNMENT 4096
 
 int diskfile = -1;
 
-void disk_open(const char *diskfile_path) {
+int block_size = DEFAULT_BLOCK_SIZE;
+
+/**
+ * How the disk file is driven, DISK_SYNC, DISK_URING or DISK_MMAP.
+ */
+static int diskBackend = DISK_SYNC;
+
+/**
+ * The disk file's mapping when it's the backend, and how much of it the file backs.
+ */
+static char *diskMap = NULL;
+static off_t mapFileSize = 0;
+
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The disk file opened with O_DIRECT, -1 when the page cache is in use.
+ * Transfers the file system under it rejects are retried through diskfile.
+ */
+static int directfile = -1;
+
+static BufferPool *directPool = NULL;
+
+static size_t direct_alignment() {
+    return BLOCK_SIZE < DIRECT_ALIGNMENT ? (size_t) BLOCK_SIZE : DIRECT_ALIGNMENT;
+}
+
+/**
+ * Sizes the staging buffers to the current block size.
+ */
+static int direct_pool_open() {
+    if (directPool) {
+        pool_deallocate(directPool);
+    }
+
+    directPool = pool_allocate(DIRECT_POOL_BUFFERS, (size_t) BLOCK_SIZE, direct_alignment());
+    return directPool ? 0 : -1;
+}
+
+/**
+ * Opens the disk file a second time with O_DIRECT so transfers bypass the page cache.
+ */
+static void direct_open(const char *diskfile_path) {
+    directfile = open(diskfile_path, O_RDWR | O_DIRECT);
+    if (directfile < 0) {
+        perror("O_DIRECT is unavailable, falling back to buffered I/O");
+        return;
+    }
+
+    if (direct_pool_open() < 0) {
+        fprintf(stderr, "Could not allocate O_DIRECT buffers, falling back to buffered I/O.\n");
+        close(directfile);
+        directfile = -1;
+    }
+}
+
+/**
+ * Maps the whole window over the disk file, pages past the end of the file are never touched.
+ */
+static int map_open() {
+    struct stat st;
+    if (fstat(diskfile, &st) < 0) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, MAP_WINDOW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    diskMap = (char *) map;
+    mapFileSize = st.st_size;
+    return 0;
+}
+
+/**
+ * Copies one run between the mapping and it's buffers, growing the disk file the way pwritev would.
+ * @return The bytes moved, or a negative errno.
+ */
+static ssize_t map_transfer(IoRun *run, int write) {
+    off_t end = run->offset + (off_t) run->numIov * BLOCK_SIZE;
+    if (run->offset < 0 || end > MAP_WINDOW_BYTES) {
+        return -EINVAL;
+    }
+
+    if (write && end > __atomic_load_n(&mapFileSize, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&map_mutex);
+        if (end > mapFileSize) {
+            if (ftruncate(diskfile, end) < 0) {
+                pthread_mutex_unlock(&map_mutex);
+                return -errno;
+            }
+
+            __atomic_store_n(&mapFileSize, end, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&map_mutex);
+    }
+
+    off_t fileSize = __atomic_load_n(&mapFileSize, __ATOMIC_ACQUIRE);
+    ssize_t done = 0;
+
+    int index = 0;
+    for (; index < run->numIov; index++) {
+        off_t position = run->offset + done;
+        size_t length = run->iov[index].iov_len;
+
+        if (write) {
+            memcpy(diskMap + position, run->iov[index].iov_base, length);
+        } else {
+            if (position >= fileSize) {
+                break; // Never touched, just like reading past the end of the file.
+            }
+
+            if (position + (off_t) length > fileSize) {
+                length = (size_t) (fileSize - position);
+            }
+
+            memcpy(run->iov[index].iov_base, diskMap + position, length);
+        }
+
+        done += length;
+    }
+
+    return done;
+}
+
+void disk_open(const char *diskfile_path, int backend, int direct) {
     if (diskfile >= 0) {
         return;
     }
@@ -26,22 +183,268 @@ void disk_open(const char *diskfile_path) {
         perror("disk_open failed");
         exit(EXIT_FAILURE);
     }
+
+    diskBackend = backend;
+    if (diskBackend == DISK_URING && uring_open() < 0) {
+        fprintf(stderr, "io_uring is unavailable, falling back to synchronous I/O.\n");
+        diskBackend = DISK_SYNC;
+    }
+
+    if (diskBackend == DISK_MMAP && map_open() < 0) {
+        perror("Could not map the disk, falling back to synchronous I/O");
+        diskBackend = DISK_SYNC;
+    }
+
+    if (direct && diskBackend == DISK_MMAP) {
+        fprintf(stderr, "O_DIRECT doesn't apply to a mapped disk, ignoring it.\n");
+    } else if (direct) {
+        direct_open(diskfile_path);
+    }
 }
 
 void disk_close() {
+    if (diskMap) {
+        munmap(diskMap, MAP_WINDOW_BYTES);
+        diskMap = NULL;
+    }
+
+    if (directfile >= 0) {
+        close(directfile);
+        directfile = -1;
+    }
+
+    if (directPool) {
+        pool_deallocate(directPool);
+        directPool = NULL;
+    }
+
     if (diskfile >= 0) {
         close(diskfile);
+        diskfile = -1;
     }
 }
 
-/** Read a block from an open file
+/** Make everything written to the disk file durable
+ *
+ * Dirty pages of the mapping are written with msync, otherwise the disk file is fsync'd. A disk file larger than the
+ * mapping window is fsync'd as well, the blocks past the window went through pwritev. Returns 0 on success, or a
+ * negative value when failed.
+ */
+int disk_sync() {
+    int retstat;
+    if (diskMap) {
+        off_t fileSize = __atomic_load_n(&mapFileSize, __ATOMIC_ACQUIRE);
+        size_t length = (size_t) (fileSize < MAP_WINDOW_BYTES ? fileSize : MAP_WINDOW_BYTES);
+
+        retstat = msync(diskMap, length, MS_SYNC);
+        if (retstat == 0 && fileSize > MAP_WINDOW_BYTES) {
+            retstat = fsync(diskfile);
+        }
+    } else {
+        retstat = fsync(diskfile);
+    }
+
+    if (retstat < 0)
+        perror("disk_sync failed");
+
+    return retstat;
+}
+
+/** Change the size of every block moved from here on
+ *
+ * The size must be a power of two between @MIN_BLOCK_SIZE and @MAX_BLOCK_SIZE. Returns 0 on success, or a negative
+ * value when the size is rejected.
+ */
+int disk_set_block_size(int size) {
+    if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+        return -1;
+    }
+
+    block_size = size;
+
+    if (directfile >= 0 && direct_pool_open() < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs every run against the disk file, through io_uring or the mapping when either is the backend.
+ * A thread that can't get a ring, or a run outside the mapping, falls back to preadv/pwritev.
+ * With O_DIRECT, a run the file system rejects is retried through the page cache.
+ */
+static void disk_transfer(IoRun *runs, int numRuns, int write) {
+    int fd = directfile >= 0 ? directfile : diskfile;
+
+    if (diskBackend != DISK_URING || uring_transfer(fd, runs, numRuns, write) < 0) {
+        int index = 0;
+        for (; index < numRuns; index++) {
+            IoRun *run = runs + index;
+            if (diskMap) {
+                run->done = map_transfer(run, write);
+                if (run->done != -EINVAL) {
+                    continue;
+                }
+            }
+
+            run->done = write ? pwritev(fd, run->iov, run->numIov, run->offset)
+                              : preadv(fd, run->iov, run->numIov, run->offset);
+            if (run->done < 0) {
+                run->done = -errno;
+            }
+        }
+    }
+
+    if (directfile < 0) {
+        return;
+    }
+
+    int index = 0;
+    for (; index < numRuns; index++) {
+        IoRun *run = runs + index;
+        if (run->done != -EINVAL) {
+            continue;
+        }
+
+        run->done = write ? pwritev(diskfile, run->iov, run->numIov, run->offset)
+                          : preadv(diskfile, run->iov, run->numIov, run->offset);
+        if (run->done < 0) {
+            run->done = -errno;
+        }
+    }
+}
+
+/**
+ * Moves a list of blocks with one transfer per run of consecutive block numbers.
+ * Each block gets the result block_read/block_write would have given it in @status.
+ */
+static int disk_vector(const int *blocks, int count, void **bufs, int *status, int write) {
+    struct iovec *iov = (struct iovec *) malloc(sizeof(struct iovec) * count);
+    IoRun *runs = (IoRun *) malloc(sizeof(IoRun) * count);
+    if (!iov || !runs) {
+        free(iov);
+        free(runs);
+        return -1;
+    }
+
+    int numRuns = 0;
+    int first = 0;
+    while (first < count) {
+        int length = 1;
+        while (first + length < count && length < MAX_RUN_BLOCKS && blocks[first] >= 0
+               && blocks[first + length] == blocks[first] + length) {
+            length++;
+        }
+
+        int index = 0;
+        for (; index < length; index++) {
+            iov[first + index].iov_base = bufs[first + index];
+            iov[first + index].iov_len = BLOCK_SIZE;
+        }
+
+        IoRun *run = runs + numRuns++;
+        run->offset = (off_t) blocks[first] * BLOCK_SIZE;
+        run->iov = iov + first;
+        run->numIov = length;
+        run->done = 0;
+
+        first += length;
+    }
+
+    // O_DIRECT can only move blocks that sit on an aligned address, stage the others through the pool.
+    void **staged = NULL;
+    if (directfile >= 0) {
+        staged = (void **) calloc((size_t) count, sizeof(void *));
+        if (!staged) {
+            free(iov);
+            free(runs);
+            return -1;
+        }
+
+        int index = 0;
+        for (; index < count; index++) {
+            if ((uintptr_t) bufs[index] % direct_alignment() == 0 || !(staged[index] = pool_get(directPool))) {
+                continue;
+            }
+
+            if (write) {
+                memcpy(staged[index], bufs[index], BLOCK_SIZE);
+            }
+            iov[index].iov_base = staged[index];
+        }
+    }
+
+    disk_transfer(runs, numRuns, write);
+
+    if (staged) {
+        int index = 0;
+        for (; index < count; index++) {
+            if (!staged[index]) {
+                continue;
+            }
+
+            if (!write) {
+                memcpy(bufs[index], staged[index], BLOCK_SIZE);
+            }
+            pool_put(directPool, staged[index]);
+        }
+
+        free(staged);
+    }
+
+    int retstat = 0;
+
+    int runIndex = 0;
+    for (; runIndex < numRuns; runIndex++) {
+        IoRun *run = runs + runIndex;
+        first = (int) (run->iov - iov);
+
+        if (run->done < 0) {
+            fprintf(stderr, "%s failed: %s\n", write ? "block_writev" : "block_readv", strerror((int) -run->done));
+        }
+
+        int index = 0;
+        for (; index < run->numIov; index++) {
+            ssize_t start = (ssize_t) index * BLOCK_SIZE;
+            ssize_t done = run->done;
+            int moved = done < 0 ? -1 : (int) (done - start >= BLOCK_SIZE ? BLOCK_SIZE : done > start ? done - start : 0);
+
+            if (!write && moved <= 0) {
+                memset(bufs[first + index], 0, BLOCK_SIZE);
+            }
+
+            if (write && moved != BLOCK_SIZE) {
+                moved = -1; // A short write leaves the block torn.
+            }
+
+            if (moved < 0) {
+                retstat = -1;
+            }
+
+            status[first + index] = moved;
+        }
+    }
+
+    free(iov);
+    free(runs);
+
+    return retstat;
+}
+
+/** Read a block from the disk file, bypassing the block cache
  *
  * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed. 
  * In cases of error or return value equals to 0, the content of the @buf is set to 0.
  */
-int block_read(const int block_num, void *buf) {
+int disk_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num * BLOCK_SIZE);
+    if (diskBackend != DISK_SYNC || directfile >= 0) {
+        disk_vector(&block_num, 1, &buf, &retstat, 0);
+        return retstat;
+    }
+
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
     if (retstat <= 0) {
         memset(buf, 0, BLOCK_SIZE);
         if (retstat < 0)
@@ -51,16 +454,168 @@ int block_read(const int block_num, void *buf) {
     return retstat;
 }
 
-/** Write a block to an open file
+/** Write a block to the disk file, bypassing the block cache
  *
  * Write should return exactly @BLOCK_SIZE except on error. 
  */
-int block_write(const int block_num, const void *buf) {
+int disk_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num * BLOCK_SIZE);
+    if (diskBackend != DISK_SYNC || directfile >= 0) {
+        void *bufs = (void *) buf;
+        disk_vector(&block_num, 1, &bufs, &retstat, 1);
+        return retstat;
+    }
+
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
     if (retstat < 0)
         perror("block_write failed");
 
     return retstat;
 }
 
+/** Point straight at a block inside the mapped disk file
+ *
+ * Only available with the mmap backend, and only for blocks the disk file already holds. The pointer is valid until
+ * the disk is closed. Returns NULL whenever the block has to be read with block_read instead.
+ */
+const void *block_pointer(const int block_num) {
+    if (!diskMap || cache_enabled()) {
+        return NULL;
+    }
+
+    off_t offset = (off_t) block_num * BLOCK_SIZE;
+    if (block_num < 0 || offset + BLOCK_SIZE > __atomic_load_n(&mapFileSize, __ATOMIC_ACQUIRE)
+        || offset + BLOCK_SIZE > MAP_WINDOW_BYTES) {
+        return NULL;
+    }
+
+    return diskMap + offset;
+}
+
+/** Start reading blocks a file is about to need
+ *
+ * Fills the block cache when one is configured, otherwise asks the kernel to bring the blocks into the page cache.
+ * Only a hint: failures are ignored and the later read does the real work.
+ */
+void block_prefetch(const int *blocks, int count) {
+    if (cache_enabled()) {
+        cache_prefetch(blocks, count);
+        return;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    int index = 0;
+    while (index < count) {
+        // Hint whole runs of consecutive blocks at a time.
+        int length = 1;
+        while (index + length < count && blocks[index + length] == blocks[index] + length) {
+            length++;
+        }
+
+        off_t offset = (off_t) blocks[index] * BLOCK_SIZE;
+        off_t bytes = (off_t) length * BLOCK_SIZE;
+
+        if (diskMap) {
+            off_t start = offset - offset % pageSize;
+            if (offset + bytes <= MAP_WINDOW_BYTES) {
+                madvise(diskMap + start, (size_t) (offset + bytes - start), MADV_WILLNEED);
+            }
+        } else {
+            posix_fadvise(diskfile, offset, bytes, POSIX_FADV_WILLNEED);
+        }
+
+        index += length;
+    }
+}
+
+/** Read many blocks from the disk file, bypassing the block cache
+ *
+ * Returns 0 when every block was read (or never touched), or a negative value when any failed.
+ */
+int disk_readv(const int *blocks, int count, void **bufs, int *status) {
+    return disk_vector(blocks, count, bufs, status, 0);
+}
+
+/** Write many blocks to the disk file, bypassing the block cache
+ *
+ * Returns 0 when every block was written, or a negative value when any failed.
+ */
+int disk_writev(const int *blocks, int count, void **bufs, int *status) {
+    return disk_vector(blocks, count, bufs, status, 1);
+}
+
+/** Read a block from an open file
+ *
+ * Same contract as disk_read, but hot blocks are served from the block cache when one is configured.
+ */
+int block_read(const int block_num, void *buf) {
+    return cache_read(block_num, buf);
+}
+
+/** Write a block to an open file
+ *
+ * With the block cache configured the block is only marked dirty, block_flush makes it durable.
+ */
+int block_write(const int block_num, const void *buf) {
+    return cache_write(block_num, buf);
+}
+
+/** Write back every dirty cached block
+ *
+ * Returns 0 when every block reached the disk file, or a negative value when failed.
+ */
+int block_flush() {
+    return cache_flush();
+}
+
+/**
+ * Runs a vectored cache call over a flat buffer of @count blocks.
+ */
+static int block_vector(const int *blocks, int count, const void *buf, int *status,
+                        int (*transfer)(const int *, int, void **, int *)) {
+    if (count <= 0) {
+        return 0;
+    }
+
+    void **bufs = (void **) malloc(sizeof(void *) * count);
+    int *statuses = status ? status : (int *) malloc(sizeof(int) * count);
+    if (!bufs || !statuses) {
+        free(bufs);
+        if (!status)
+            free(statuses);
+        return -1;
+    }
+
+    int index = 0;
+    for (; index < count; index++) {
+        bufs[index] = (char *) buf + (size_t) index * BLOCK_SIZE;
+    }
+
+    int retstat = transfer(blocks, count, bufs, statuses);
+
+    free(bufs);
+    if (!status)
+        free(statuses);
+
+    return retstat;
+}
+
+/** Read many blocks from an open file
+ *
+ * Block i of @blocks lands at @buf + i * @BLOCK_SIZE. Runs of consecutive block numbers that miss the cache are
+ * read with a single syscall. Returns 0 when every block was read (or never touched), or a negative value when any
+ * failed, @status holds what block_read would have returned for each block.
+ */
+int block_readv(const int *blocks, int count, void *buf, int *status) {
+    return block_vector(blocks, count, buf, status, cache_readv);
+}
+
+/** Write many blocks to an open file
+ *
+ * Block i of @blocks is taken from @buf + i * @BLOCK_SIZE. Returns 0 when every block was written, or a negative
+ * value when any failed, @status holds what block_write would have returned for each block.
+ */
+int block_writev(const int *blocks, int count, const void *buf, int *status) {
+    return block_vector(blocks, count, buf, status, cache_writev);
+}
@@ -8,11 +8,38 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 512
+// Block sizes a disk can be formatted with.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_BLOCK_SIZE 4096
 
-void disk_open(const char* diskfile_path);
+// The block size of the open disk, recorded in it's super block when it was formatted.
+extern int block_size;
+#define BLOCK_SIZE block_size
+
+// Ways of driving the disk file, picked at mount time.
+#define DISK_SYNC 0
+#define DISK_URING 1
+#define DISK_MMAP 2
+
+void disk_open(const char* diskfile_path, int backend, int direct);
 void disk_close();
+int disk_set_block_size(int size);
+int disk_sync();
 int block_read(const int block_num, void *buf);
 int block_write(const int block_num, const void *buf);
+int block_flush();
+const void *block_pointer(const int block_num);
+void block_prefetch(const int *blocks, int count);
+
+// Many blocks at once, @buf holds @count consecutive blocks and @status (may be NULL) gets each block's result.
+int block_readv(const int *blocks, int count, void *buf, int *status);
+int block_writev(const int *blocks, int count, const void *buf, int *status);
+
+// Straight to the disk file, used by the block cache.
+int disk_read(const int block_num, void *buf);
+int disk_write(const int block_num, const void *buf);
+int disk_readv(const int *blocks, int count, void **bufs, int *status);
+int disk_writev(const int *blocks, int count, void **bufs, int *status);
 
 #endif
@@ -0,0 +1,654 @@
+#include "blockmap.h"
+#include "indirect.h"
+
+/**
+ * The top bit of an extent's length on the disk, set while the extent is unwritten.
+ */
+#define EXTENT_UNWRITTEN 0x80000000u
+
+/**
+ * The most extents one i-node can map.
+ */
+#define MAX_EXTENTS (INODE_EXTENTS + MAX_EXTENT_LEAVES * LEAF_EXTENTS)
+
+/**
+ * The extents that didn't fit in the i-node. They're stored in leaf blocks, listed in order by the extent block.
+ */
+struct ExtentOverflow {
+    /**
+     * The extent block.
+     */
+    int block;
+
+    int numLeaves;
+    int leafBlocks[MAX_EXTENT_LEAVES];
+    LinkExtent *leaves[MAX_EXTENT_LEAVES];
+
+    /**
+     * Whether the extent block and each leaf changed since they were last written.
+     */
+    bool dirty;
+    bool leafDirty[MAX_EXTENT_LEAVES];
+};
+
+/**
+ * Whether new i-nodes map their links indirectly.
+ */
+static bool indirectByDefault = false;
+
+void links_set_mode(bool indirect) {
+    indirectByDefault = indirect;
+}
+
+void links_init(INode *node) {
+    node->indirect = indirectByDefault;
+    indirect_init(node);
+
+    node->numExtents = 0;
+    memset(node->extents, 0, sizeof(node->extents));
+    node->overflow = NULL;
+}
+
+void links_release(INode *node) {
+    if (node->indirect) {
+        indirect_release(node);
+        return;
+    }
+
+    struct ExtentOverflow *overflow = node->overflow;
+    if (!overflow) {
+        return;
+    }
+
+    int leaf = 0;
+    for (; leaf < overflow->numLeaves; leaf++) {
+        free(overflow->leaves[leaf]);
+    }
+
+    free(overflow);
+    node->overflow = NULL;
+}
+
+/**
+ * Returns the extent at @index, counting through the i-node's own extents and then the leaf blocks' in order.
+ */
+static LinkExtent *link_extent(INode *node, int index) {
+    if (index < INODE_EXTENTS) {
+        return node->extents + index;
+    }
+
+    index -= INODE_EXTENTS;
+    return node->overflow->leaves[index / LEAF_EXTENTS] + index % LEAF_EXTENTS;
+}
+
+/**
+ * Marks the leaf holding the extent at @index as changed.
+ */
+static void mark_dirty(INode *node, int index) {
+    if (index >= INODE_EXTENTS) {
+        node->overflow->leafDirty[(index - INODE_EXTENTS) / LEAF_EXTENTS] = true;
+    }
+}
+
+/**
+ * Finds the last extent starting at or before @link.
+ * @return It's index, -1 if every extent starts after @link.
+ */
+static int find_extent(INode *node, int link) {
+    int found = -1;
+
+    int low = 0;
+    int high = node->numExtents - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (link_extent(node, middle)->link <= link) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Finds the extent holding @link.
+ * @return The extent, NULL if the link is a hole.
+ */
+static LinkExtent *extent_of(INode *node, int link) {
+    int index = find_extent(node, link);
+    if (index < 0) {
+        return NULL;
+    }
+
+    LinkExtent *extent = link_extent(node, index);
+    return link < extent->link + extent->length ? extent : NULL;
+}
+
+int links_max(INode *node) {
+    return node->indirect ? indirect_max_links() : MAX_FILE_LINKS;
+}
+
+int link_block(INode *node, int link) {
+    if (node->indirect) {
+        return indirect_block(node, link);
+    }
+
+    LinkExtent *extent = extent_of(node, link);
+    return extent ? extent->block + (link - extent->link) : -1;
+}
+
+bool link_unwritten(INode *node, int link) {
+    if (node->indirect) {
+        return indirect_unwritten(node, link);
+    }
+
+    LinkExtent *extent = extent_of(node, link);
+    return extent ? extent->unwritten : false;
+}
+
+/**
+ * Drops empty extents and joins neighbours whose links and blocks both line up, in place.
+ * @return The number of extents left.
+ */
+static int merge(LinkExtent *list, int count) {
+    int kept = 0;
+
+    int index = 0;
+    for (; index < count; index++) {
+        if (list[index].length <= 0) {
+            continue;
+        }
+
+        if (kept > 0) {
+            LinkExtent *last = list + kept - 1;
+            if (last->link + last->length == list[index].link && last->block + last->length == list[index].block
+                && last->unwritten == list[index].unwritten) {
+                last->length += list[index].length;
+                continue;
+            }
+        }
+
+        list[kept++] = list[index];
+    }
+
+    return kept;
+}
+
+/**
+ * Adds leaf blocks until there are @numLeaves of them, setting up the extent block first if there is none yet.
+ * Leaves stay until the i-node is destroyed, even once fewer extents would do.
+ * @return 0 on success, -1 if a block or it's memory couldn't be had.
+ */
+static int grow_leaves(INode *node, int numLeaves, int goal) {
+    struct ExtentOverflow *overflow = node->overflow;
+    if (!overflow) {
+        overflow = (struct ExtentOverflow *) calloc(1, sizeof(struct ExtentOverflow));
+        if (!overflow) {
+            return -1;
+        }
+
+        int length = 0;
+        overflow->block = block_reserve_run(goal, 1, &length);
+        if (overflow->block == -1) {
+            free(overflow);
+            return -1;
+        }
+
+        overflow->dirty = true;
+        node->overflow = overflow;
+    }
+
+    while (overflow->numLeaves < numLeaves) {
+        int previous = overflow->numLeaves > 0 ? overflow->leafBlocks[overflow->numLeaves - 1] : overflow->block;
+
+        LinkExtent *leaf = (LinkExtent *) calloc((size_t) LEAF_EXTENTS, sizeof(LinkExtent));
+        if (!leaf) {
+            return -1;
+        }
+
+        int length = 0;
+        int block = block_reserve_run(previous + 1, 1, &length);
+        if (block == -1) {
+            free(leaf);
+            return -1;
+        }
+
+        overflow->leafBlocks[overflow->numLeaves] = block;
+        overflow->leaves[overflow->numLeaves] = leaf;
+        overflow->leafDirty[overflow->numLeaves] = true;
+        overflow->numLeaves++;
+        overflow->dirty = true;
+    }
+
+    return 0;
+}
+
+/**
+ * Replaces the @removed extents from @first on with the @count extents of @list, shifting the ones behind them. Every
+ * leaf holding an extent that moved is marked for writing.
+ * @return 0 on success, -1 if the extents no longer fit, leaving them as they were.
+ */
+static int splice(INode *node, int first, int removed, LinkExtent *list, int count) {
+    int numExtents = node->numExtents - removed + count;
+    if (numExtents > MAX_EXTENTS) {
+        return -1;
+    }
+
+    if (numExtents > INODE_EXTENTS) {
+        int numLeaves = (numExtents - INODE_EXTENTS + LEAF_EXTENTS - 1) / LEAF_EXTENTS;
+        if (grow_leaves(node, numLeaves, list[0].block) < 0) {
+            return -1;
+        }
+    }
+
+    int shift = count - removed;
+    int index;
+    if (shift > 0) {
+        for (index = node->numExtents - 1; index >= first + removed; index--) {
+            *link_extent(node, index + shift) = *link_extent(node, index);
+            mark_dirty(node, index + shift);
+        }
+    } else if (shift < 0) {
+        for (index = first + removed; index < node->numExtents; index++) {
+            *link_extent(node, index + shift) = *link_extent(node, index);
+            mark_dirty(node, index + shift);
+        }
+    }
+
+    for (index = 0; index < count; index++) {
+        *link_extent(node, first + index) = list[index];
+        mark_dirty(node, first + index);
+    }
+
+    node->numExtents = numExtents;
+    return 0;
+}
+
+int link_set_unwritten(INode *node, int link, bool unwritten) {
+    if (node->indirect) {
+        return indirect_set_unwritten(node, link, unwritten);
+    }
+
+    int index = find_extent(node, link);
+    if (index < 0) {
+        return -1;
+    }
+
+    LinkExtent extent = *link_extent(node, index);
+    if (link >= extent.link + extent.length) {
+        return -1;
+    }
+
+    if (extent.unwritten == unwritten) {
+        return 0;
+    }
+
+    // The extent splits into the links before, the link itself and the links after. Along with the neighbours on
+    // either side, the merge joins back whatever lines up.
+    int first = index > 0 ? index - 1 : index;
+    int end = index + 1 < node->numExtents ? index + 2 : index + 1;
+
+    LinkExtent list[5];
+    int count = 0;
+    if (first < index) {
+        list[count++] = *link_extent(node, first);
+    }
+
+    list[count] = extent;
+    list[count++].length = link - extent.link;
+
+    list[count] = extent;
+    list[count].link = link;
+    list[count].block = extent.block + (link - extent.link);
+    list[count].length = 1;
+    list[count++].unwritten = unwritten;
+
+    list[count] = extent;
+    list[count].link = link + 1;
+    list[count].block = extent.block + (link + 1 - extent.link);
+    list[count++].length = extent.link + extent.length - (link + 1);
+
+    if (end > index + 1) {
+        list[count++] = *link_extent(node, index + 1);
+    }
+
+    return splice(node, first, end - first, list, merge(list, count));
+}
+
+int link_map(INode *node, int link, int block, int length, bool unwritten) {
+    if (node->indirect) {
+        return indirect_map(node, link, block, length, unwritten);
+    }
+
+    if (link < 0 || length <= 0 || link + length > MAX_FILE_LINKS) {
+        return -1;
+    }
+
+    int index = find_extent(node, link);
+    LinkExtent *previous = index >= 0 ? link_extent(node, index) : NULL;
+    if (previous && link < previous->link + previous->length) {
+        return -1;
+    }
+
+    LinkExtent *next = index + 1 < node->numExtents ? link_extent(node, index + 1) : NULL;
+    if (next && next->link < link + length) {
+        return -1;
+    }
+
+    // The new extent goes between it's neighbours, the merge grows either of them instead when they line up.
+    int first = previous ? index : index + 1;
+    int end = next ? index + 2 : index + 1;
+
+    LinkExtent list[3];
+    int count = 0;
+    if (previous) {
+        list[count++] = *previous;
+    }
+
+    list[count].link = link;
+    list[count].block = block;
+    list[count].length = length;
+    list[count++].unwritten = unwritten;
+
+    if (next) {
+        list[count++] = *next;
+    }
+
+    return splice(node, first, end - first, list, merge(list, count));
+}
+
+/**
+ * Returns how many blocks the extent block and it's leaves take to hold @numExtents extents.
+ */
+static int overflow_blocks(int numExtents) {
+    if (numExtents > MAX_EXTENTS) {
+        numExtents = MAX_EXTENTS; // Past that mapping fails anyway, it never takes another block.
+    }
+
+    return numExtents <= INODE_EXTENTS ? 0 : 1 + (numExtents - INODE_EXTENTS + LEAF_EXTENTS - 1) / LEAF_EXTENTS;
+}
+
+int links_metadata_needed(INode *node, int link, int countPending(int first, int last, void *extra), void *extra) {
+    if (node->indirect) {
+        return indirect_metadata_needed(node, link, countPending, extra);
+    }
+
+    int held = node->overflow ? 1 + node->overflow->numLeaves : 0;
+    int numExtents = node->numExtents + countPending(0, MAX_FILE_LINKS - 1, extra);
+
+    int before = overflow_blocks(numExtents) - held;
+    int after = overflow_blocks(numExtents + 1) - held;
+
+    return (after > 0 ? after : 0) - (before > 0 ? before : 0);
+}
+
+int link_goal(INode *node, int link) {
+    if (node->indirect) {
+        return indirect_goal(node, link);
+    }
+
+    int index = find_extent(node, link - 1);
+    if (index < 0) {
+        return -1;
+    }
+
+    LinkExtent *extent = link_extent(node, index);
+
+    int previous = extent->link + extent->length - 1;
+    if (previous > link - 1) {
+        previous = link - 1;
+    }
+
+    if (previous < FIRST_DATA_LINK) {
+        return -1;
+    }
+
+    return extent->block + (previous - extent->link) + (link - previous);
+}
+
+static void write_extent(ByteBuffer *byteBuffer, LinkExtent *extent) {
+    writeInt(byteBuffer, (__uint32_t) extent->link);
+    writeInt(byteBuffer, (__uint32_t) extent->block);
+    writeInt(byteBuffer, (__uint32_t) extent->length | (extent->unwritten ? EXTENT_UNWRITTEN : 0));
+}
+
+static void read_extent(ByteBuffer *byteBuffer, LinkExtent *extent) {
+    extent->link = (int) readInt(byteBuffer);
+    extent->block = (int) readInt(byteBuffer);
+
+    __uint32_t length = readInt(byteBuffer);
+    extent->length = (int) (length & ~EXTENT_UNWRITTEN);
+    extent->unwritten = (length & EXTENT_UNWRITTEN) != 0;
+}
+
+void links_serialize(INode *node, ByteBuffer *byteBuffer) {
+    writeByte(byteBuffer, node->indirect);
+    if (node->indirect) {
+        indirect_serialize(node, byteBuffer);
+        return;
+    }
+
+    writeInt(byteBuffer, (__uint32_t) node->numExtents);
+    writeInt(byteBuffer, (__uint32_t) (node->overflow ? node->overflow->block : -1));
+
+    int index = 0;
+    for (; index < INODE_EXTENTS; index++) {
+        write_extent(byteBuffer, node->extents + index);
+    }
+}
+
+/**
+ * Reads the extent block and every leaf it lists, then the extents the leaves hold.
+ * @return 0 on success, -1 if a block couldn't be read or doesn't make sense.
+ */
+static int load_overflow(INode *node, int block) {
+    Byte buffer[BLOCK_SIZE];
+    if (block_read(block, buffer) <= 0) {
+        return -1;
+    }
+
+    ByteBuffer byteBuffer = {0, BLOCK_SIZE, buffer};
+
+    int numLeaves = (int) readInt(&byteBuffer);
+    if (numLeaves < 0 || numLeaves > MAX_EXTENT_LEAVES || INODE_EXTENTS + numLeaves * LEAF_EXTENTS < node->numExtents) {
+        return -1;
+    }
+
+    struct ExtentOverflow *overflow = (struct ExtentOverflow *) calloc(1, sizeof(struct ExtentOverflow));
+    Byte *leaves = (Byte *) malloc((size_t) (numLeaves > 0 ? numLeaves : 1) * BLOCK_SIZE);
+    if (!overflow || !leaves) {
+        free(overflow);
+        free(leaves);
+        return -1;
+    }
+
+    overflow->block = block;
+    node->overflow = overflow;
+
+    int leaf = 0;
+    for (; leaf < numLeaves; leaf++) {
+        overflow->leafBlocks[leaf] = (int) readInt(&byteBuffer);
+        overflow->leaves[leaf] = (LinkExtent *) calloc((size_t) LEAF_EXTENTS, sizeof(LinkExtent));
+        if (!overflow->leaves[leaf]) {
+            free(leaves);
+            return -1;
+        }
+        overflow->numLeaves++;
+    }
+
+    if (numLeaves > 0 && block_readv(overflow->leafBlocks, numLeaves, leaves, NULL) < 0) {
+        free(leaves);
+        return -1;
+    }
+
+    int index = INODE_EXTENTS;
+    for (leaf = 0; leaf < numLeaves; leaf++) {
+        ByteBuffer leafBuffer = {0, BLOCK_SIZE, leaves + (size_t) leaf * BLOCK_SIZE};
+
+        int slot = 0;
+        for (; slot < LEAF_EXTENTS && index < node->numExtents; slot++, index++) {
+            read_extent(&leafBuffer, link_extent(node, index));
+        }
+    }
+
+    free(leaves);
+    return 0;
+}
+
+int links_load(INode *node, ByteBuffer *byteBuffer) {
+    links_init(node);
+
+    node->indirect = readByte(byteBuffer) != 0;
+    if (node->indirect) {
+        indirect_load(node, byteBuffer);
+        return 0;
+    }
+
+    node->numExtents = (int) readInt(byteBuffer);
+    int overflowBlock = (int) readInt(byteBuffer);
+
+    int index = 0;
+    for (; index < INODE_EXTENTS; index++) {
+        read_extent(byteBuffer, node->extents + index);
+    }
+
+    // The extent block is loaded even when the i-node holds every extent, so it's leaves can be freed later.
+    if (overflowBlock == -1) {
+        return node->numExtents <= INODE_EXTENTS ? 0 : -1;
+    }
+
+    if (node->numExtents > MAX_EXTENTS || load_overflow(node, overflowBlock) < 0) {
+        node->numExtents = node->numExtents < INODE_EXTENTS ? node->numExtents : INODE_EXTENTS;
+        return -1; // Keep what the i-node itself maps.
+    }
+
+    return 0;
+}
+
+int links_dirty_blocks(INode *node) {
+    if (node->indirect) {
+        return indirect_dirty_blocks(node);
+    }
+
+    struct ExtentOverflow *overflow = node->overflow;
+    if (!overflow) {
+        return 0;
+    }
+
+    int count = overflow->dirty ? 1 : 0;
+
+    int leaf = 0;
+    for (; leaf < overflow->numLeaves; leaf++) {
+        count += overflow->leafDirty[leaf];
+    }
+
+    return count;
+}
+
+int links_serialize_dirty(INode *node, int *blocks, Byte *buffer) {
+    if (node->indirect) {
+        return indirect_serialize_dirty(node, blocks, buffer);
+    }
+
+    struct ExtentOverflow *overflow = node->overflow;
+    if (!overflow) {
+        return 0;
+    }
+
+    // Cleared before the copy, under the i-node's lock like every change, so nothing changed meanwhile is lost.
+    int count = 0;
+    if (overflow->dirty) {
+        overflow->dirty = false;
+
+        ByteBuffer byteBuffer = {0, 0, buffer};
+        memset(buffer, 0, BLOCK_SIZE);
+
+        writeInt(&byteBuffer, (__uint32_t) overflow->numLeaves);
+
+        int leaf = 0;
+        for (; leaf < overflow->numLeaves; leaf++) {
+            writeInt(&byteBuffer, (__uint32_t) overflow->leafBlocks[leaf]);
+        }
+
+        blocks[count++] = overflow->block;
+    }
+
+    int leaf = 0;
+    for (; leaf < overflow->numLeaves; leaf++) {
+        if (!overflow->leafDirty[leaf]) {
+            continue;
+        }
+
+        overflow->leafDirty[leaf] = false;
+
+        ByteBuffer byteBuffer = {0, 0, buffer + (size_t) count * BLOCK_SIZE};
+        memset(byteBuffer.buffer, 0, BLOCK_SIZE);
+
+        int index = INODE_EXTENTS + leaf * LEAF_EXTENTS;
+        int end = index + LEAF_EXTENTS;
+        for (; index < end && index < node->numExtents; index++) {
+            write_extent(&byteBuffer, link_extent(node, index));
+        }
+
+        blocks[count++] = overflow->leafBlocks[leaf];
+    }
+
+    return count;
+}
+
+int links_blocks(INode *node, int *blocks) {
+    if (node->indirect) {
+        return indirect_blocks(node, blocks);
+    }
+
+    int count = 0;
+
+    struct ExtentOverflow *overflow = node->overflow;
+    if (overflow) {
+        if (blocks) {
+            blocks[0] = overflow->block;
+            memcpy(blocks + 1, overflow->leafBlocks, sizeof(int) * overflow->numLeaves);
+        }
+
+        count = 1 + overflow->numLeaves;
+    }
+
+    int index = 0;
+    for (; index < node->numExtents; index++) {
+        LinkExtent *extent = link_extent(node, index);
+
+        int offset = 0;
+        for (; offset < extent->length; offset++, count++) {
+            if (blocks) {
+                blocks[count] = extent->block + offset;
+            }
+        }
+    }
+
+    return count;
+}
+
+int links_first_hole(INode *node) {
+    int position = 0;
+
+    if (node->indirect) {
+        int maxLinks = indirect_max_links();
+        for (; position < maxLinks && indirect_block(node, position) != -1; position++);
+
+        return position < maxLinks ? position : -1;
+    }
+
+    // The extents are sorted, so the first gap between them is the first free link.
+    int index = 0;
+    for (; index < node->numExtents; index++) {
+        LinkExtent *extent = link_extent(node, index);
+        if (extent->link > position)
+            return position;
+
+        position = extent->link + extent->length;
+    }
+
+    return position < MAX_FILE_LINKS ? position : -1;
+}
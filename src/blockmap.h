@@ -0,0 +1,106 @@
+#ifndef ASSIGNMENT3_BLOCKMAP_H
+#define ASSIGNMENT3_BLOCKMAP_H
+
+#include "helper.h"
+
+/**
+ * Picks how the i-nodes made from now on map their links: by extents, or by block pointers and indirect blocks.
+ */
+void links_set_mode(_Bool indirect);
+
+/**
+ * Empties an i-node's map and sets it to the current mode, without releasing anything it pointed at.
+ */
+void links_init(INode *);
+
+/**
+ * Frees the memory of an i-node's map. The blocks it maps are left reserved.
+ */
+void links_release(INode *);
+
+/**
+ * Returns how many links the i-node's map can reach.
+ */
+int links_max(INode *);
+
+/**
+ * Finds the data block a link is mapped to, a binary search over the extents or a walk down the indirect blocks.
+ * @return The block, -1 if the link is a hole.
+ */
+int link_block(INode *, int link);
+
+/**
+ * Returns whether the block behind a link was preallocated and never written.
+ */
+_Bool link_unwritten(INode *, int link);
+
+/**
+ * Marks the block behind a mapped link as preallocated but unwritten, or as holding data. When mapped by extents, the
+ * link's extent is split around it and merged back into it's neighbours where they line up.
+ * @return 0 on success, -1 if the split needs more extents than the i-node can hold.
+ */
+int link_set_unwritten(INode *, int link, _Bool unwritten);
+
+/**
+ * Maps @length unmapped links from @link on to the consecutive blocks from @block on, growing the extent before it
+ * when they line up.
+ * @return 0 on success, -1 if a link was already mapped or the i-node can't hold another extent or indirect block.
+ */
+int link_map(INode *, int link, int block, int length, _Bool unwritten);
+
+/**
+ * Returns how many more blocks the map could have to take to map the unmapped @link at write back, on top of the
+ * blocks it needs for the other links waiting to be mapped. @countPending counts those links within a range.
+ * For extents it's a worst case, every waiting link may end up as an extent of it's own. For indirect blocks it's the
+ * missing blocks on the way down to @link that no other waiting link needs.
+ * @return The number of blocks, -1 if the map couldn't be read.
+ */
+int links_metadata_needed(INode *, int link, int countPending(int first, int last, void *extra), void *extra);
+
+/**
+ * Returns where a block for @link would best go: behind the block of the closest mapped link before it, at the same
+ * distance, so the file stays contiguous.
+ * @return The block, -1 if no data link before it is mapped.
+ */
+int link_goal(INode *, int link);
+
+/**
+ * Writes the i-node's mode, then it's block pointers or it's own extents with the extent count and the extent block
+ * ahead of them.
+ */
+void links_serialize(INode *, ByteBuffer *);
+
+/**
+ * Reads the i-node's block pointers or own extents back, then the extent block and it's leaf blocks when there are
+ * any. Indirect blocks are only read once they're needed.
+ * @return 0 on success, -1 if the overflow extents couldn't be read.
+ */
+int links_load(INode *, ByteBuffer *);
+
+/**
+ * Returns how many of the extent block and leaf blocks, or of the cached indirect blocks, changed since they were last
+ * written.
+ */
+int links_dirty_blocks(INode *);
+
+/**
+ * Fills @buffer with every extent, leaf or indirect block that changed since it was last written, and @blocks with
+ * where each one goes. Must be called with the i-node's lock held.
+ * @return The number of blocks filled in.
+ */
+int links_serialize_dirty(INode *, int *blocks, Byte *buffer);
+
+/**
+ * Lists every block the map holds into @blocks, if it isn't NULL: the data blocks along with the extent and leaf
+ * blocks or the indirect blocks.
+ * @return The number of them, -1 if an indirect block couldn't be read.
+ */
+int links_blocks(INode *, int *blocks);
+
+/**
+ * Returns the first link that isn't mapped.
+ * @return The link, -1 if every link the map can reach is mapped.
+ */
+int links_first_hole(INode *);
+
+#endif //ASSIGNMENT3_BLOCKMAP_H
@@ -0,0 +1,750 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "cache.h"
+
+/**
+ * Marks an empty frame, or the end of a hash chain.
+ */
+#define NO_BLOCK -1
+
+/**
+ * Frames are allocated on this boundary so they can be handed straight to the disk file.
+ */
+#define FRAME_ALIGNMENT 4096
+
+/**
+ * Once this share of the frames (in percent) is dirty, writes flush them all in one sweep.
+ */
+#define DIRTY_HIGH_PERCENT 75
+
+typedef struct {
+    /**
+     * The block held by this frame, NO_BLOCK if it is empty.
+     */
+    int block;
+
+    /**
+     * What the disk returned for this block, 0 if it was never written.
+     */
+    int length;
+
+    /**
+     * Whether the frame holds data the disk file hasn't seen yet.
+     */
+    bool dirty;
+
+    /**
+     * Second chance bit for the clock hand.
+     */
+    bool referenced;
+
+    /**
+     * Being filled from the disk with the cache mutex let go, it's contents aren't there until it's cleared.
+     */
+    bool busy;
+
+    /**
+     * Being written back with the cache mutex let go, it can be read but mustn't change until it's cleared.
+     */
+    bool writing;
+
+    /**
+     * The next frame in this frame's hash chain.
+     */
+    int next;
+
+    char *data;
+} Frame;
+
+static Frame *frames = NULL;
+static int numFrames = 0;
+
+static int *buckets = NULL;
+static unsigned int bucketMask = 0;
+
+static char *slab = NULL;
+static int clockHand = 0;
+
+static int numDirty = 0;
+
+/**
+ * Scratch space for building the ascending flush sweep, sized to the frames at init.
+ */
+static int *flushOrder = NULL;
+static int *flushBlocks = NULL;
+static int *flushStatus = NULL;
+static void **flushBufs = NULL;
+
+static CacheStats stats;
+
+/**
+ * Whether a sweep is writing back, the scratch space is in use until it's done.
+ */
+static bool flushing = false;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Broadcast whenever a frame stops being busy or written back, and when a sweep is done.
+ */
+static pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int hashBlock(int block) {
+    return ((unsigned int) block * 2654435761u) & bucketMask;
+}
+
+static int lookup(int block) {
+    int index = buckets[hashBlock((unsigned int) block)];
+    for (; index != NO_BLOCK; index = frames[index].next) {
+        if (frames[index].block == block) {
+            return index;
+        }
+    }
+
+    return NO_BLOCK;
+}
+
+/**
+ * Finds a block's frame once it's done being filled, and done being written back as well if the caller is
+ * @changing it. Must be called with the cache mutex held and none of the caller's own frames busy, it's let go while
+ * waiting.
+ */
+static int lookup_ready(int block, bool changing) {
+    int index = lookup(block);
+    while (index != NO_BLOCK && (frames[index].busy || (changing && frames[index].writing))) {
+        pthread_cond_wait(&frame_cond, &cache_mutex);
+        index = lookup(block);
+    }
+
+    return index;
+}
+
+static void unchain(int index) {
+    int *link = &buckets[hashBlock(frames[index].block)];
+    for (; *link != NO_BLOCK; link = &frames[*link].next) {
+        if (*link == index) {
+            *link = frames[index].next;
+            break;
+        }
+    }
+
+    frames[index].block = NO_BLOCK;
+    frames[index].next = NO_BLOCK;
+}
+
+static void chain(int index, int block) {
+    unsigned int bucket = hashBlock(block);
+
+    frames[index].block = block;
+    frames[index].next = buckets[bucket];
+    buckets[bucket] = index;
+}
+
+static void mark_dirty(Frame *frame) {
+    if (!frame->dirty) {
+        frame->dirty = true;
+        numDirty++;
+    }
+}
+
+static int compare_frames(const void *a, const void *b) {
+    int left = frames[*(const int *) a].block, right = frames[*(const int *) b].block;
+    return left < right ? -1 : left > right;
+}
+
+/**
+ * Writes back every dirty frame in one ascending sweep over the disk, so neighbouring blocks go out as single writes.
+ * Must be called with the cache mutex held and none of the caller's own frames busy, it's let go while the blocks
+ * are written.
+ * @return 0 on success, -1 if any write back failed.
+ */
+static int flush_dirty() {
+    // Sweeps share the scratch space, a second one waits for the first and then picks up whatever it didn't write.
+    while (flushing) {
+        pthread_cond_wait(&frame_cond, &cache_mutex);
+    }
+
+    int count = 0;
+
+    int index = 0;
+    for (; index < numFrames; index++) {
+        if (frames[index].block != NO_BLOCK && frames[index].dirty && !frames[index].busy) {
+            flushOrder[count++] = index;
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(flushOrder, (size_t) count, sizeof(int), compare_frames);
+
+    int merges = 0;
+    for (index = 0; index < count; index++) {
+        frames[flushOrder[index]].writing = true;
+
+        flushBlocks[index] = frames[flushOrder[index]].block;
+        flushBufs[index] = frames[flushOrder[index]].data;
+
+        if (index > 0 && flushBlocks[index] == flushBlocks[index - 1] + 1) {
+            merges++;
+        }
+    }
+
+    flushing = true;
+    pthread_mutex_unlock(&cache_mutex);
+
+    int retstat = disk_writev(flushBlocks, count, flushBufs, flushStatus);
+
+    pthread_mutex_lock(&cache_mutex);
+    flushing = false;
+
+    for (index = 0; index < count; index++) {
+        frames[flushOrder[index]].writing = false;
+
+        if (flushStatus[index] != BLOCK_SIZE) {
+            continue; // Stays dirty for the next sweep.
+        }
+
+        frames[flushOrder[index]].dirty = false;
+        numDirty--;
+        stats.writebacks++;
+    }
+
+    stats.flushes++;
+    stats.merges += merges;
+    stats.lastMerges = merges;
+
+    pthread_cond_broadcast(&frame_cond);
+    return retstat;
+}
+
+/**
+ * Flushes once too much of the cache is dirty, so there are always clean frames left to claim. Must be called with
+ * the cache mutex held and none of the caller's own frames busy.
+ */
+static void relieve_pressure() {
+    if (!flushing && numDirty * 100 > numFrames * DIRTY_HIGH_PERCENT) {
+        flush_dirty();
+    }
+}
+
+/**
+ * Drops the clean frames of blocks that were just written around the cache, a read could have brought their old
+ * contents in while the mutex was let go. Must be called with the cache mutex held and none of the caller's own
+ * frames busy.
+ */
+static void invalidate(const int *blocks, int count) {
+    int index = 0;
+    for (; index < count; index++) {
+        int frameIndex = blocks[index] < 0 ? NO_BLOCK : lookup_ready(blocks[index], true);
+        if (frameIndex != NO_BLOCK && !frames[frameIndex].dirty) {
+            unchain(frameIndex);
+        }
+    }
+}
+
+/**
+ * Runs the clock hand until it finds a clean frame to give to @block. Dirty frames are left to the sweeps, which
+ * relieve_pressure keeps enough of the cache clean for, so claiming a frame never waits on the disk.
+ * Must be called with the cache mutex held.
+ * @return The claimed frame, or NO_BLOCK if every frame is dirty or in use.
+ */
+static int claim(int block) {
+    int sweeps = numFrames * 2 + 1; // Two passes clear every second chance bit.
+    for (; sweeps > 0; sweeps--) {
+        int index = clockHand;
+        Frame *frame = frames + index;
+
+        clockHand = (clockHand + 1) % numFrames;
+
+        if (frame->busy || frame->writing) {
+            continue;
+        }
+
+        if (frame->block != NO_BLOCK) {
+            if (frame->referenced) {
+                frame->referenced = false;
+                continue;
+            }
+
+            if (frame->dirty) {
+                continue;
+            }
+
+            unchain(index);
+            stats.evictions++;
+        }
+
+        chain(index, block);
+        frame->length = 0;
+        frame->dirty = false;
+        frame->referenced = true;
+        return index;
+    }
+
+    return NO_BLOCK;
+}
+
+int cache_init(size_t budget) {
+    int count = (int) (budget / BLOCK_SIZE);
+    if (count <= 0) {
+        return 0; // Running uncached.
+    }
+
+    unsigned int numBuckets = 1;
+    while (numBuckets < (unsigned int) count * 2) {
+        numBuckets <<= 1;
+    }
+
+    frames = (Frame *) calloc((size_t) count, sizeof(Frame));
+    buckets = (int *) malloc(sizeof(int) * numBuckets);
+    flushOrder = (int *) malloc(sizeof(int) * count * 3);
+    flushBufs = (void **) malloc(sizeof(void *) * count);
+    if (!frames || !buckets || !flushOrder || !flushBufs
+        || posix_memalign((void **) &slab, FRAME_ALIGNMENT, (size_t) count * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Could not allocate %d cache frames.\n", count);
+        free(frames);
+        free(buckets);
+        free(flushOrder);
+        free(flushBufs);
+        frames = NULL;
+        buckets = NULL;
+        flushOrder = NULL;
+        flushBufs = NULL;
+        slab = NULL;
+        return -1;
+    }
+
+    flushBlocks = flushOrder + count;
+    flushStatus = flushOrder + count * 2;
+
+    int index = 0;
+    for (; index < count; index++) {
+        frames[index].block = NO_BLOCK;
+        frames[index].next = NO_BLOCK;
+        frames[index].data = slab + (size_t) index * BLOCK_SIZE;
+    }
+
+    unsigned int bucket = 0;
+    for (; bucket < numBuckets; bucket++) {
+        buckets[bucket] = NO_BLOCK;
+    }
+
+    bucketMask = numBuckets - 1;
+    numFrames = count;
+    numDirty = 0;
+    clockHand = 0;
+    flushing = false;
+
+    memset(&stats, 0, sizeof(CacheStats));
+    stats.numFrames = count;
+    return 0;
+}
+
+void cache_destroy() {
+    if (!frames) {
+        return;
+    }
+
+    cache_flush();
+
+    pthread_mutex_lock(&cache_mutex);
+    free(frames);
+    free(buckets);
+    free(slab);
+    free(flushOrder);
+    free(flushBufs);
+
+    frames = NULL;
+    buckets = NULL;
+    slab = NULL;
+    flushOrder = NULL;
+    flushBufs = NULL;
+    numFrames = 0;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+bool cache_enabled() {
+    return frames != NULL;
+}
+
+int cache_read(const int block_num, void *buf) {
+    if (!frames || block_num < 0) {
+        return disk_read(block_num, buf);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    int index = lookup_ready(block_num, false);
+    if (index != NO_BLOCK) {
+        Frame *frame = frames + index;
+        frame->referenced = true;
+        stats.hits++;
+
+        memcpy(buf, frame->data, BLOCK_SIZE);
+
+        int length = frame->length;
+        pthread_mutex_unlock(&cache_mutex);
+        return length;
+    }
+
+    stats.misses++;
+
+    index = claim(block_num);
+    if (index == NO_BLOCK) {
+        pthread_mutex_unlock(&cache_mutex);
+        return disk_read(block_num, buf);
+    }
+
+    Frame *frame = frames + index;
+    frame->busy = true;
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    int retstat = disk_read(block_num, frame->data);
+
+    pthread_mutex_lock(&cache_mutex);
+    frame->busy = false;
+
+    if (retstat < 0) {
+        unchain(index); // Don't keep a frame for a block we couldn't read.
+    } else {
+        frame->length = retstat;
+    }
+
+    memcpy(buf, frame->data, BLOCK_SIZE);
+
+    pthread_cond_broadcast(&frame_cond);
+    pthread_mutex_unlock(&cache_mutex);
+    return retstat;
+}
+
+int cache_write(const int block_num, const void *buf) {
+    if (!frames || block_num < 0) {
+        return disk_write(block_num, buf);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    int index = lookup_ready(block_num, true);
+    if (index != NO_BLOCK) {
+        frames[index].referenced = true;
+        stats.hits++;
+    } else {
+        stats.misses++;
+
+        index = claim(block_num);
+        if (index == NO_BLOCK) {
+            pthread_mutex_unlock(&cache_mutex);
+
+            int retstat = disk_write(block_num, buf);
+
+            pthread_mutex_lock(&cache_mutex);
+            invalidate(&block_num, 1);
+            pthread_mutex_unlock(&cache_mutex);
+            return retstat;
+        }
+    }
+
+    Frame *frame = frames + index;
+    memcpy(frame->data, buf, BLOCK_SIZE);
+    frame->length = BLOCK_SIZE;
+    mark_dirty(frame);
+
+    relieve_pressure();
+
+    pthread_mutex_unlock(&cache_mutex);
+    return BLOCK_SIZE;
+}
+
+int cache_readv(const int *blocks, int count, void **bufs, int *status) {
+    if (!frames) {
+        return disk_readv(blocks, count, bufs, status);
+    }
+
+    int *missing = (int *) malloc(sizeof(int) * count * 4);
+    void **missingBufs = (void **) malloc(sizeof(void *) * count);
+    if (!missing || !missingBufs) {
+        free(missing);
+        free(missingBufs);
+        return disk_readv(blocks, count, bufs, status);
+    }
+
+    int *missingBlocks = missing + count;
+    int *missingStatus = missing + count * 2;
+    int *claimed = missing + count * 3;
+
+    int retstat = 0;
+    int numMissing = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    int index = 0;
+    for (; index < count; index++) {
+        int frameIndex = blocks[index] < 0 ? NO_BLOCK : lookup_ready(blocks[index], false);
+        if (frameIndex == NO_BLOCK) {
+            missing[numMissing++] = index;
+            stats.misses++;
+            continue;
+        }
+
+        Frame *frame = frames + frameIndex;
+        frame->referenced = true;
+        stats.hits++;
+
+        memcpy(bufs[index], frame->data, BLOCK_SIZE);
+        status[index] = frame->length;
+    }
+
+    bool bypass = numMissing > numFrames / 2;
+
+    int numRead = 0;
+    int miss = 0;
+    for (; miss < numMissing; miss++) {
+        index = missing[miss];
+
+        // Brought in by someone else while we waited on a fill above, unless it's still being filled.
+        int frameIndex = blocks[index] < 0 ? NO_BLOCK : lookup(blocks[index]);
+        if (frameIndex != NO_BLOCK && !frames[frameIndex].busy) {
+            memcpy(bufs[index], frames[frameIndex].data, BLOCK_SIZE);
+            status[index] = frames[frameIndex].length;
+            continue;
+        }
+
+        claimed[numRead] = NO_BLOCK;
+        if (!bypass && frameIndex == NO_BLOCK && blocks[index] >= 0) {
+            claimed[numRead] = claim(blocks[index]);
+        }
+
+        missing[numRead] = index;
+        missingBlocks[numRead] = blocks[index];
+        if (claimed[numRead] == NO_BLOCK) {
+            missingBufs[numRead] = bufs[index];
+        } else {
+            frames[claimed[numRead]].busy = true;
+            missingBufs[numRead] = frames[claimed[numRead]].data;
+        }
+
+        numRead++;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (numRead > 0) {
+        retstat = disk_readv(missingBlocks, numRead, missingBufs, missingStatus);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    for (miss = 0; miss < numRead; miss++) {
+        index = missing[miss];
+        status[index] = missingStatus[miss];
+
+        if (claimed[miss] == NO_BLOCK) {
+            continue;
+        }
+
+        Frame *frame = frames + claimed[miss];
+        frame->busy = false;
+
+        if (status[index] < 0) {
+            unchain(claimed[miss]);
+        } else {
+            frame->length = status[index];
+        }
+
+        memcpy(bufs[index], frame->data, BLOCK_SIZE);
+    }
+
+    pthread_cond_broadcast(&frame_cond);
+    pthread_mutex_unlock(&cache_mutex);
+
+    free(missing);
+    free(missingBufs);
+    return retstat;
+}
+
+int cache_writev(const int *blocks, int count, void **bufs, int *status) {
+    if (!frames) {
+        return disk_writev(blocks, count, bufs, status);
+    }
+
+    int *missing = (int *) malloc(sizeof(int) * count * 3);
+    void **missingBufs = (void **) malloc(sizeof(void *) * count);
+    if (!missing || !missingBufs) {
+        free(missing);
+        free(missingBufs);
+        return disk_writev(blocks, count, bufs, status);
+    }
+
+    int *directBlocks = missing + count;
+    int *directStatus = missing + count * 2;
+
+    int retstat = 0;
+    int numMissing = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    int index = 0;
+    for (; index < count; index++) {
+        int frameIndex = blocks[index] < 0 ? NO_BLOCK : lookup_ready(blocks[index], true);
+        if (frameIndex == NO_BLOCK) {
+            missing[numMissing++] = index;
+            stats.misses++;
+            continue;
+        }
+
+        Frame *frame = frames + frameIndex;
+        frame->referenced = true;
+        stats.hits++;
+
+        memcpy(frame->data, bufs[index], BLOCK_SIZE);
+        frame->length = BLOCK_SIZE;
+        mark_dirty(frame);
+        status[index] = BLOCK_SIZE;
+    }
+
+    bool bypass = numMissing > numFrames / 2;
+
+    int numDirect = 0;
+    int miss = 0;
+    for (; miss < numMissing; miss++) {
+        index = missing[miss];
+
+        // The same block may appear twice in one batch, or have been brought in while we waited above.
+        int frameIndex = blocks[index] < 0 ? NO_BLOCK : lookup_ready(blocks[index], true);
+        if (frameIndex == NO_BLOCK && !bypass && blocks[index] >= 0) {
+            frameIndex = claim(blocks[index]);
+        }
+
+        if (frameIndex == NO_BLOCK) {
+            missing[numDirect] = index;
+            directBlocks[numDirect] = blocks[index];
+            missingBufs[numDirect] = bufs[index];
+            numDirect++;
+            continue;
+        }
+
+        Frame *frame = frames + frameIndex;
+        memcpy(frame->data, bufs[index], BLOCK_SIZE);
+        frame->length = BLOCK_SIZE;
+        mark_dirty(frame);
+        status[index] = BLOCK_SIZE;
+    }
+
+    if (numDirect > 0) {
+        pthread_mutex_unlock(&cache_mutex);
+        retstat = disk_writev(directBlocks, numDirect, missingBufs, directStatus);
+        pthread_mutex_lock(&cache_mutex);
+
+        int direct = 0;
+        for (; direct < numDirect; direct++) {
+            status[missing[direct]] = directStatus[direct];
+        }
+
+        invalidate(directBlocks, numDirect);
+    }
+
+    relieve_pressure();
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    free(missing);
+    free(missingBufs);
+    return retstat;
+}
+
+int cache_prefetch(const int *blocks, int count) {
+    if (!frames) {
+        return 0;
+    }
+
+    int *claimed = (int *) malloc(sizeof(int) * count * 3);
+    void **claimedBufs = (void **) malloc(sizeof(void *) * count);
+    if (!claimed || !claimedBufs) {
+        free(claimed);
+        free(claimedBufs);
+        return -1;
+    }
+
+    int *claimedBlocks = claimed + count;
+    int *claimedStatus = claimed + count * 2;
+
+    int retstat = 0;
+    int numClaimed = 0;
+    int limit = numFrames / 4; // Read-ahead mustn't push out more than a quarter of the cache.
+
+    pthread_mutex_lock(&cache_mutex);
+
+    int index = 0;
+    for (; index < count && numClaimed < limit; index++) {
+        if (blocks[index] < 0 || lookup(blocks[index]) != NO_BLOCK) {
+            continue;
+        }
+
+        int frameIndex = claim(blocks[index]);
+        if (frameIndex == NO_BLOCK) {
+            break;
+        }
+
+        frames[frameIndex].busy = true;
+        frames[frameIndex].referenced = false; // Only a real read earns the second chance.
+
+        claimed[numClaimed] = frameIndex;
+        claimedBlocks[numClaimed] = blocks[index];
+        claimedBufs[numClaimed] = frames[frameIndex].data;
+        numClaimed++;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (numClaimed > 0) {
+        retstat = disk_readv(claimedBlocks, numClaimed, claimedBufs, claimedStatus);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    for (index = 0; index < numClaimed; index++) {
+        Frame *frame = frames + claimed[index];
+        frame->busy = false;
+
+        if (claimedStatus[index] < 0) {
+            unchain(claimed[index]);
+            continue;
+        }
+
+        frame->length = claimedStatus[index];
+        stats.prefetches++;
+    }
+
+    pthread_cond_broadcast(&frame_cond);
+    pthread_mutex_unlock(&cache_mutex);
+
+    free(claimed);
+    free(claimedBufs);
+    return retstat;
+}
+
+int cache_flush() {
+    if (!frames) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    int retstat = flush_dirty();
+    pthread_mutex_unlock(&cache_mutex);
+
+    return retstat;
+}
+
+void cache_stats(CacheStats *out) {
+    pthread_mutex_lock(&cache_mutex);
+    memcpy(out, &stats, sizeof(CacheStats));
+    pthread_mutex_unlock(&cache_mutex);
+}
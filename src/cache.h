@@ -0,0 +1,120 @@
+#ifndef ASSIGNMENT3_CACHE_H
+#define ASSIGNMENT3_CACHE_H
+
+#include <stddef.h>
+
+/**
+ * The default memory budget of the block cache, in bytes.
+ */
+#define DEFAULT_CACHE_BYTES (8 * 1024 * 1024)
+
+/**
+ * Counters describing how well the block cache is doing.
+ */
+typedef struct {
+    /**
+     * Number of frames the cache was sized to.
+     */
+    int numFrames;
+
+    /**
+     * Reads and writes satisfied by a resident frame.
+     */
+    unsigned long hits;
+
+    /**
+     * Reads and writes that had to claim a frame.
+     */
+    unsigned long misses;
+
+    /**
+     * Frames taken away from another block.
+     */
+    unsigned long evictions;
+
+    /**
+     * Dirty frames written back to the disk file.
+     */
+    unsigned long writebacks;
+
+    /**
+     * Blocks brought in by read-ahead before anyone asked for them.
+     */
+    unsigned long prefetches;
+
+    /**
+     * Sweeps that wrote back the dirty frames, on flush or once too many frames were dirty.
+     */
+    unsigned long flushes;
+
+    /**
+     * Dirty blocks that went out in the same write as the block before them, over every sweep.
+     */
+    unsigned long merges;
+
+    /**
+     * Merges achieved by the most recent sweep.
+     */
+    int lastMerges;
+} CacheStats;
+
+/**
+ * Sizes the cache to the given memory budget. A budget smaller than a block disables the cache.
+ * @return 0 on success, -1 on failure.
+ */
+int cache_init(size_t budget);
+
+/**
+ * Writes back every dirty frame and releases the cache.
+ */
+void cache_destroy();
+
+/**
+ * Returns whether or not the cache is holding blocks.
+ */
+_Bool cache_enabled();
+
+/**
+ * Reads a block through the cache, with the same contract as block_read.
+ * @return BLOCK_SIZE, 0 for a block that was never written, or a negative value on failure.
+ */
+int cache_read(const int block_num, void *buf);
+
+/**
+ * Writes a block into the cache, it reaches the disk on eviction or flush.
+ * @return BLOCK_SIZE, or a negative value on failure.
+ */
+int cache_write(const int block_num, const void *buf);
+
+/**
+ * Reads many blocks through the cache, misses are fetched from the disk file in as few calls as possible.
+ * Large batches of misses go around the cache so a streaming read doesn't wipe it.
+ * @return 0 on success, -1 if any block failed, @status holds each block's block_read result.
+ */
+int cache_readv(const int *blocks, int count, void **bufs, int *status);
+
+/**
+ * Writes many blocks into the cache, large batches of misses go straight to the disk file.
+ * @return 0 on success, -1 if any block failed, @status holds each block's block_write result.
+ */
+int cache_writev(const int *blocks, int count, void **bufs, int *status);
+
+/**
+ * Brings blocks into the cache ahead of a read, blocks already resident are skipped.
+ * Prefetched frames don't get a second chance, so read-ahead nobody uses is the first thing evicted.
+ * @return 0 on success, -1 if any block failed.
+ */
+int cache_prefetch(const int *blocks, int count);
+
+/**
+ * Writes back every dirty frame in ascending block order, adjacent blocks merged into single writes.
+ * @return 0 on success, -1 if any write back failed.
+ */
+int cache_flush();
+
+/**
+ * Copies the current counters.
+ */
+void cache_stats(CacheStats *);
+
+#endif //ASSIGNMENT3_CACHE_H
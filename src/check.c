@@ -0,0 +1,73 @@
+#include <time.h>
+
+#include "check.h"
+#include "group.h"
+
+static bool running = false;
+static int checkInterval = 0;
+static pthread_t worker;
+
+static pthread_mutex_t check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+
+int check_counters() {
+    int repaired = groups_check_free() + node_check_free();
+
+    log_msg("\ncheck: free blocks=%ld free i-nodes=%d repaired=%d\n", groups_free_blocks(),
+            superBlock->numFreeINodes, repaired);
+    return repaired;
+}
+
+static void *check_worker(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&check_mutex);
+    while (running) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += checkInterval;
+
+        // Sleep out the interval, unless check_stop wakes us first.
+        if (pthread_cond_timedwait(&check_cond, &check_mutex, &wake) != ETIMEDOUT || !running) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&check_mutex);
+        check_counters();
+        pthread_mutex_lock(&check_mutex);
+    }
+    pthread_mutex_unlock(&check_mutex);
+
+    return NULL;
+}
+
+int check_start(int interval) {
+    if (interval <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&check_mutex);
+    checkInterval = interval;
+    running = true;
+    pthread_mutex_unlock(&check_mutex);
+
+    if (pthread_create(&worker, NULL, check_worker, NULL) != 0) {
+        running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void check_stop() {
+    pthread_mutex_lock(&check_mutex);
+    if (!running) {
+        pthread_mutex_unlock(&check_mutex);
+        return;
+    }
+
+    running = false;
+    pthread_cond_signal(&check_cond);
+    pthread_mutex_unlock(&check_mutex);
+
+    pthread_join(worker, NULL);
+}
@@ -0,0 +1,24 @@
+#ifndef ASSIGNMENT3_CHECK_H
+#define ASSIGNMENT3_CHECK_H
+
+#include "helper.h"
+
+/**
+ * Recounts both bit maps with popcount and checks the free block and free i-node counts against them, repairing the
+ * counts that drifted.
+ * @return The number of counts that had to be repaired.
+ */
+int check_counters();
+
+/**
+ * Starts a worker that runs check_counters every @interval seconds, in the background of the file system.
+ * @return 0 on success, -1 if the worker couldn't be started.
+ */
+int check_start(int interval);
+
+/**
+ * Stops the worker, waiting for a check that is running to finish.
+ */
+void check_stop();
+
+#endif //ASSIGNMENT3_CHECK_H
@@ -0,0 +1,371 @@
+#include "delalloc.h"
+#include "blockmap.h"
+#include "group.h"
+#include "itable.h"
+
+/**
+ * A full block written to a link that has no data block yet.
+ */
+typedef struct {
+    int link;
+    Byte *data;
+} PendingBlock;
+
+/**
+ * The blocks written to one i-node that are still waiting for data blocks.
+ */
+typedef struct Pending {
+    INode *node;
+
+    /**
+     * The blocks, sorted by link.
+     */
+    PendingBlock *blocks;
+
+    int count, capacity;
+
+    /**
+     * The extent, leaf or indirect blocks set aside for mapping the blocks at write back, at worst.
+     */
+    long reserved;
+
+    struct Pending *next;
+} Pending;
+
+static Pending *pendingList = NULL;
+static long numPending = 0;
+static long numReserved = 0;
+
+static pthread_mutex_t delalloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Pending **find(INode *node) {
+    Pending **link = &pendingList;
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->node == node) {
+            break;
+        }
+    }
+
+    return link;
+}
+
+/**
+ * Finds where @link is, or would go, among the pending blocks.
+ * @return The index of the first block at or after @link.
+ */
+static int find_block(Pending *pending, int link) {
+    int low = 0;
+    int high = pending->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (pending->blocks[middle].link < link) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Counts the pending blocks of @extra between the links @first and @last.
+ */
+static int count_pending(int first, int last, void *extra) {
+    Pending *pending = (Pending *) extra;
+
+    int end = last < INT_MAX ? find_block(pending, last + 1) : pending->count;
+    return end - find_block(pending, first);
+}
+
+static void release(Pending *pending) {
+    int index = 0;
+    for (; index < pending->count; index++) {
+        free(pending->blocks[index].data);
+    }
+
+    numPending -= pending->count;
+    numReserved -= pending->reserved;
+    node_put(pending->node);
+    free(pending->blocks);
+    free(pending);
+}
+
+int delalloc_store(INode *node, int link, const Byte *block) {
+    pthread_mutex_lock(&delalloc_mutex);
+
+    Pending *pending = *find(node);
+    if (!pending) {
+        pending = (Pending *) calloc(1, sizeof(Pending));
+        if (!pending) {
+            pthread_mutex_unlock(&delalloc_mutex);
+            return -ENOMEM;
+        }
+
+        pending->node = node; // Held until it's blocks are written back, so the i-node cache can't evict it.
+        node_hold(node);
+        pending->next = pendingList;
+        pendingList = pending;
+    }
+
+    int index = find_block(pending, link);
+    if (index == pending->count || pending->blocks[index].link != link) {
+        // Pending blocks count against the free space now, along with whatever the map could need to take for them,
+        // so write back can't run out of it later.
+        int metadata = links_metadata_needed(node, link, count_pending, pending);
+        if (metadata < 0) {
+            pthread_mutex_unlock(&delalloc_mutex);
+            return -EIO;
+        }
+
+        if (numPending + numReserved + 1 + metadata > groups_free_blocks()) {
+            pthread_mutex_unlock(&delalloc_mutex);
+            return -ENOSPC;
+        }
+
+        if (pending->count == pending->capacity) {
+            int capacity = pending->capacity ? pending->capacity * 2 : 16;
+            PendingBlock *blocks = (PendingBlock *) realloc(pending->blocks, sizeof(PendingBlock) * capacity);
+            if (!blocks) {
+                pthread_mutex_unlock(&delalloc_mutex);
+                return -ENOMEM;
+            }
+
+            pending->blocks = blocks;
+            pending->capacity = capacity;
+        }
+
+        Byte *data = (Byte *) malloc(BLOCK_SIZE);
+        if (!data) {
+            pthread_mutex_unlock(&delalloc_mutex);
+            return -ENOMEM;
+        }
+
+        memmove(pending->blocks + index + 1, pending->blocks + index, sizeof(PendingBlock) * (pending->count - index));
+        pending->blocks[index].link = link;
+        pending->blocks[index].data = data;
+
+        pending->count++;
+        numPending++;
+
+        pending->reserved += metadata;
+        numReserved += metadata;
+    }
+
+    memcpy(pending->blocks[index].data, block, BLOCK_SIZE);
+
+    pthread_mutex_unlock(&delalloc_mutex);
+    return 0;
+}
+
+int delalloc_load(INode *node, int link, Byte *block) {
+    pthread_mutex_lock(&delalloc_mutex);
+
+    Pending *pending = *find(node);
+
+    int index = pending ? find_block(pending, link) : 0;
+    int found = pending && index < pending->count && pending->blocks[index].link == link;
+    if (found) {
+        memcpy(block, pending->blocks[index].data, BLOCK_SIZE);
+    }
+
+    pthread_mutex_unlock(&delalloc_mutex);
+    return found;
+}
+
+/**
+ * Allocates and writes out one i-node's pending blocks, dropping each one once it's linked. Must be called with the
+ * i-node's lock and the delalloc mutex held, the pending blocks stay readable until they are on the disk and whatever couldn't be linked
+ * stays pending.
+ * @return 0 on success, -ENOSPC if a block couldn't be had or mapped, -EIO if the blocks couldn't be written.
+ */
+static int flush_pending(Pending *pending) {
+    INode *node = pending->node;
+    if (pending->count == 0) {
+        return 0;
+    }
+
+    Byte *buffer = (Byte *) malloc((size_t) pending->count * BLOCK_SIZE);
+    int *blocks = (int *) malloc(sizeof(int) * pending->count);
+    if (!buffer || !blocks) {
+        free(buffer);
+        free(blocks);
+        return -ENOMEM;
+    }
+
+    // Each run of pending links gets one contiguous run of blocks, holes between them stay holes. Nothing is linked
+    // until it's written, so readers keep seeing the pending data until it is on the disk.
+    int numBlocks = 0;
+    while (numBlocks < pending->count) {
+        int link = pending->blocks[numBlocks].link;
+
+        int wanted = 1;
+        while (numBlocks + wanted < pending->count && pending->blocks[numBlocks + wanted].link == link + wanted) {
+            wanted++;
+        }
+
+        // Aim behind the run before this one, or behind the blocks the file already has.
+        int goal = numBlocks > 0 ? blocks[numBlocks - 1] + (link - pending->blocks[numBlocks - 1].link)
+                                 : link_goal(node, link);
+
+        int length = 0;
+        int block = block_reserve_run(goal, wanted, &length);
+        if (block == -1) {
+            while (numBlocks > 0) { // Hand back the runs reserved so far.
+                block_unreserve(blocks[--numBlocks]);
+            }
+
+            free(buffer);
+            free(blocks);
+            return -ENOSPC;
+        }
+
+        int index = 0;
+        for (; index < length; index++) {
+            blocks[numBlocks++] = block + index;
+        }
+    }
+
+    int index = 0;
+    for (; index < numBlocks; index++) {
+        memcpy(buffer + (size_t) index * BLOCK_SIZE, pending->blocks[index].data, BLOCK_SIZE);
+    }
+
+    int retstat = block_writev(blocks, numBlocks, buffer, NULL);
+    free(buffer);
+
+    // Nothing is linked when the write fails, the data stays pending and the blocks go back for the next try.
+    if (retstat < 0) {
+        for (index = 0; index < numBlocks; index++) {
+            block_unreserve(blocks[index]);
+        }
+
+        free(blocks);
+        return -EIO;
+    }
+
+    // Blocks that can't be linked stay pending and give their data blocks back.
+    int kept = 0;
+    index = 0;
+    while (index < numBlocks) {
+        int length = 1;
+        while (index + length < numBlocks && pending->blocks[index + length].link == pending->blocks[index].link + length
+               && blocks[index + length] == blocks[index] + length) {
+            length++;
+        }
+
+        bool linked = link_map(node, pending->blocks[index].link, blocks[index], length, false) == 0;
+
+        int end = index + length;
+        for (; index < end; index++) {
+            if (linked) {
+                free(pending->blocks[index].data);
+                numPending--;
+            } else {
+                block_unreserve(blocks[index]);
+                pending->blocks[kept++] = pending->blocks[index];
+            }
+        }
+    }
+
+    free(blocks);
+
+    retstat = 0;
+    if (kept > 0) {
+        fprintf(stderr, "I-node %lu has no room to map %d more blocks.\n", (unsigned long) node->id, kept);
+        retstat = -ENOSPC;
+    }
+    pending->count = kept;
+
+    // Whatever did get linked goes out with the bit maps even when the rest failed, or the blocks it took would still
+    // read as free on the disk once the i-node is written back.
+    int nodeFlushed = flush_iNode(node);
+    int superFlushed = flush_super();
+    if (retstat < 0) {
+        return retstat;
+    }
+
+    return nodeFlushed < 0 || superFlushed < 0 ? -EIO : 0;
+}
+
+int delalloc_flush(INode *node) {
+    pthread_mutex_lock(&delalloc_mutex);
+
+    Pending **link = find(node);
+    Pending *pending = *link;
+    if (!pending) {
+        pthread_mutex_unlock(&delalloc_mutex);
+        return 0;
+    }
+
+    int retstat = flush_pending(pending);
+    if (pending->count == 0) {
+        *link = pending->next;
+        release(pending);
+    }
+
+    pthread_mutex_unlock(&delalloc_mutex);
+    return retstat;
+}
+
+int delalloc_flush_all() {
+    pthread_mutex_lock(&delalloc_mutex);
+
+    int count = 0;
+    Pending *pending = pendingList;
+    for (; pending; pending = pending->next) {
+        count++;
+    }
+
+    INode **nodes = count > 0 ? (INode **) malloc(sizeof(INode *) * count) : NULL;
+    if (!nodes) {
+        pthread_mutex_unlock(&delalloc_mutex);
+        return count > 0 ? -ENOMEM : 0;
+    }
+
+    int index = 0;
+    for (pending = pendingList; pending; pending = pending->next) {
+        node_hold(pending->node);
+        nodes[index++] = pending->node;
+    }
+
+    pthread_mutex_unlock(&delalloc_mutex);
+
+    // Each i-node's lock comes before the delalloc mutex, so they're flushed one at a time from the list taken above.
+    int retstat = 0;
+    for (index = 0; index < count; index++) {
+        node_lock(nodes[index]);
+        int flushed = delalloc_flush(nodes[index]);
+        node_unlock(nodes[index]);
+
+        if (flushed < 0) {
+            retstat = flushed;
+        }
+
+        node_put(nodes[index]);
+    }
+
+    free(nodes);
+    return retstat;
+}
+
+void delalloc_drop(INode *node) {
+    pthread_mutex_lock(&delalloc_mutex);
+
+    Pending **link = find(node);
+    Pending *pending = *link;
+    if (pending) {
+        *link = pending->next;
+        release(pending);
+    }
+
+    pthread_mutex_unlock(&delalloc_mutex);
+}
+
+long delalloc_blocks() {
+    pthread_mutex_lock(&delalloc_mutex);
+    long count = numPending + numReserved;
+    pthread_mutex_unlock(&delalloc_mutex);
+
+    return count;
+}
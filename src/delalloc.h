@@ -0,0 +1,51 @@
+#ifndef ASSIGNMENT3_DELALLOC_H
+#define ASSIGNMENT3_DELALLOC_H
+
+#include "helper.h"
+
+/**
+ * Once this many bytes of writes are waiting for blocks, every file is written back.
+ */
+#define DELALLOC_MAX_BYTES (4 * 1024 * 1024)
+
+/**
+ * Holds a full block written to a link that has no data block yet. The block is only allocated at write back, when
+ * the whole run of pending links is known and can be placed contiguously. The blocks the map could need to take for
+ * it are set aside as well, so write back never runs out of room.
+ * @return 0 on success, -ENOSPC if the disk couldn't hold every pending block and it's map, -ENOMEM on allocation
+ * failure, -EIO if the map couldn't be read.
+ */
+int delalloc_store(INode *, int link, const Byte *block);
+
+/**
+ * Copies the pending block of a link into @block.
+ * @return 1 if the link had a pending block, 0 otherwise.
+ */
+int delalloc_load(INode *, int link, Byte *block);
+
+/**
+ * Allocates data blocks for every pending link of the i-node in as few runs as possible, writes them out and
+ * flushes the i-node and super block. Blocks that couldn't be written or mapped stay pending. Must be called with the
+ * i-node's lock held.
+ * @return 0 on success, the negated error otherwise.
+ */
+int delalloc_flush(INode *);
+
+/**
+ * Writes back the pending blocks of every file, taking each one's lock in turn. Must be called without any i-node's
+ * lock held.
+ * @return 0 on success, the negated error of the last file that failed otherwise.
+ */
+int delalloc_flush_all();
+
+/**
+ * Throws away the pending blocks of an i-node that is going away, they never touch the allocator or the disk.
+ */
+void delalloc_drop(INode *);
+
+/**
+ * Returns the number of blocks waiting to be allocated, along with the map blocks set aside for them.
+ */
+long delalloc_blocks();
+
+#endif //ASSIGNMENT3_DELALLOC_H
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+
+#include "extent.h"
+
+#define BY_START 0
+#define BY_LENGTH 1
+
+static int compare(int order, const Extent *a, const Extent *b) {
+    if (order == BY_LENGTH && a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    }
+
+    return a->start < b->start ? -1 : a->start > b->start; // Starts are unique, so they break every tie.
+}
+
+static int height(Extent *extent, int order) {
+    return extent ? extent->height[order] : 0;
+}
+
+static void update(Extent *extent, int order) {
+    int left = height(extent->child[order][0], order), right = height(extent->child[order][1], order);
+    extent->height[order] = 1 + (left > right ? left : right);
+}
+
+/**
+ * Rotates the extent down towards @side (1 for right, 0 for left), it's other child takes it's place.
+ */
+static Extent *rotate(Extent *extent, int order, int side) {
+    Extent *up = extent->child[order][!side];
+    extent->child[order][!side] = up->child[order][side];
+    up->child[order][side] = extent;
+
+    update(extent, order);
+    update(up, order);
+    return up;
+}
+
+static Extent *balance(Extent *extent, int order) {
+    update(extent, order);
+
+    int side = 0;
+    for (; side < 2; side++) {
+        Extent *heavy = extent->child[order][side];
+        if (height(heavy, order) - height(extent->child[order][!side], order) <= 1) {
+            continue;
+        }
+
+        if (height(heavy->child[order][!side], order) > height(heavy->child[order][side], order)) {
+            extent->child[order][side] = rotate(heavy, order, side);
+        }
+
+        return rotate(extent, order, !side);
+    }
+
+    return extent;
+}
+
+static Extent *insert(Extent *root, Extent *extent, int order) {
+    if (!root) {
+        extent->child[order][0] = extent->child[order][1] = NULL;
+        extent->height[order] = 1;
+        return extent;
+    }
+
+    int side = compare(order, extent, root) > 0;
+    root->child[order][side] = insert(root->child[order][side], extent, order);
+    return balance(root, order);
+}
+
+static Extent *remove_first(Extent *root, int order) {
+    if (!root->child[order][0]) {
+        return root->child[order][1];
+    }
+
+    root->child[order][0] = remove_first(root->child[order][0], order);
+    return balance(root, order);
+}
+
+static Extent *remove_extent(Extent *root, Extent *extent, int order) {
+    if (!root) {
+        return NULL;
+    }
+
+    int side = compare(order, extent, root);
+    if (side != 0) {
+        root->child[order][side > 0] = remove_extent(root->child[order][side > 0], extent, order);
+        return balance(root, order);
+    }
+
+    Extent *left = root->child[order][0], *right = root->child[order][1];
+    if (!left || !right) {
+        return left ? left : right;
+    }
+
+    Extent *next = right;
+    while (next->child[order][0]) {
+        next = next->child[order][0];
+    }
+
+    next->child[order][1] = remove_first(right, order);
+    next->child[order][0] = left;
+    return balance(next, order);
+}
+
+static void extent_link(ExtentTree *tree, Extent *extent) {
+    tree->byStart = insert(tree->byStart, extent, BY_START);
+    tree->byLength = insert(tree->byLength, extent, BY_LENGTH);
+    tree->numExtents++;
+}
+
+static void extent_unlink(ExtentTree *tree, Extent *extent) {
+    tree->byStart = remove_extent(tree->byStart, extent, BY_START);
+    tree->byLength = remove_extent(tree->byLength, extent, BY_LENGTH);
+    tree->numExtents--;
+}
+
+/**
+ * The extent starting closest at or before @position.
+ */
+static Extent *floor_start(ExtentTree *tree, int position) {
+    Extent *best = NULL;
+
+    Extent *extent = tree->byStart;
+    while (extent) {
+        if (extent->start <= position) {
+            best = extent;
+            extent = extent->child[BY_START][1];
+        } else {
+            extent = extent->child[BY_START][0];
+        }
+    }
+
+    return best;
+}
+
+/**
+ * The shortest extent at least @length long, the lowest one among equals.
+ */
+static Extent *ceiling_length(ExtentTree *tree, int length) {
+    Extent *best = NULL;
+
+    Extent *extent = tree->byLength;
+    while (extent) {
+        if (extent->length >= length) {
+            best = extent;
+            extent = extent->child[BY_LENGTH][0];
+        } else {
+            extent = extent->child[BY_LENGTH][1];
+        }
+    }
+
+    return best;
+}
+
+ExtentTree *extent_tree_build(BitMap *map) {
+    ExtentTree *tree = (ExtentTree *) calloc(1, sizeof(ExtentTree));
+    if (!tree) {
+        return NULL;
+    }
+
+    int start = bitmap_find_first_zero(map, 0);
+    while (start != -1) {
+        int end = bitmap_find_first_one(map, start);
+
+        if (extent_tree_free(tree, start, end - start) < 0) {
+            extent_tree_destroy(tree);
+            return NULL;
+        }
+
+        start = end < map->bits ? bitmap_find_first_zero(map, end) : -1;
+    }
+
+    return tree;
+}
+
+static void destroy(Extent *extent) {
+    if (!extent) {
+        return;
+    }
+
+    destroy(extent->child[BY_START][0]);
+    destroy(extent->child[BY_START][1]);
+    free(extent);
+}
+
+void extent_tree_destroy(ExtentTree *tree) {
+    destroy(tree->byStart);
+    free(tree);
+}
+
+int extent_tree_allocate(ExtentTree *tree, int goal, int length) {
+    Extent *extent = goal >= 0 ? floor_start(tree, goal) : NULL;
+    if (!extent || extent->start + extent->length < goal + length) {
+        extent = ceiling_length(tree, length);
+        if (!extent) {
+            return -1;
+        }
+
+        goal = extent->start;
+    }
+
+    extent_unlink(tree, extent);
+    tree->numFree -= length;
+
+    // Whatever is left on either side of the taken range goes back in, the right side reusing a fresh extent.
+    int end = extent->start + extent->length;
+    if (goal + length < end) {
+        Extent *right = (Extent *) malloc(sizeof(Extent));
+        if (right) {
+            right->start = goal + length;
+            right->length = end - right->start;
+            extent_link(tree, right);
+        } else {
+            tree->numFree -= end - (goal + length); // Leaked until the next mount rebuilds the tree.
+        }
+    }
+
+    if (goal > extent->start) {
+        extent->length = goal - extent->start;
+        extent_link(tree, extent);
+    } else {
+        free(extent);
+    }
+
+    return goal;
+}
+
+int extent_tree_find(ExtentTree *tree, int length) {
+    Extent *extent = ceiling_length(tree, length);
+    return extent ? extent->start : -1;
+}
+
+int extent_tree_free(ExtentTree *tree, int start, int length) {
+    Extent *before = floor_start(tree, start);
+    Extent *after = floor_start(tree, start + length);
+
+    int mergeBefore = before && before->start + before->length == start;
+    int mergeAfter = after && after->start == start + length;
+
+    tree->numFree += length;
+
+    // Merged neighbours are taken out and the surviving extent goes back in covering all of them.
+    Extent *extent = NULL;
+    if (mergeBefore) {
+        extent_unlink(tree, before);
+        extent = before;
+        extent->length += length;
+    }
+
+    if (mergeAfter) {
+        extent_unlink(tree, after);
+        if (extent) {
+            extent->length += after->length;
+            free(after);
+        } else {
+            extent = after;
+            extent->start = start;
+            extent->length += length;
+        }
+    }
+
+    if (!extent) {
+        extent = (Extent *) malloc(sizeof(Extent));
+        if (!extent) {
+            tree->numFree -= length;
+            return -1;
+        }
+
+        extent->start = start;
+        extent->length = length;
+    }
+
+    extent_link(tree, extent);
+    return 0;
+}
+
+size_t extent_tree_bytes(ExtentTree *tree) {
+    return sizeof(ExtentTree) + (size_t) tree->numExtents * sizeof(Extent);
+}
@@ -0,0 +1,64 @@
+#ifndef ASSIGNMENT3_EXTENT_H
+#define ASSIGNMENT3_EXTENT_H
+
+#include <stddef.h>
+
+#include "bitmap.h"
+
+/**
+ * A run of free blocks, linked into two AVL trees at once: one ordered by start, one by length.
+ */
+typedef struct Extent {
+    int start, length;
+
+    /**
+     * Children and heights in each tree, indexed by the tree's order.
+     */
+    struct Extent *child[2][2];
+    int height[2];
+} Extent;
+
+/**
+ * Free space of a bit map (or a slice of one) as extents, for best-fit searches and coalescing in O(log n).
+ */
+typedef struct {
+    Extent *byStart;
+    Extent *byLength;
+
+    int numExtents;
+    long numFree;
+} ExtentTree;
+
+/**
+ * Builds the tree from the clear bits of @map.
+ * @return The tree, NULL if it couldn't be allocated.
+ */
+ExtentTree *extent_tree_build(BitMap *map);
+
+void extent_tree_destroy(ExtentTree *);
+
+/**
+ * Takes @length free positions out of the tree: at @goal if the extent holding it has room, otherwise from the
+ * smallest extent that fits.
+ * @return The first position taken, -1 if no extent is long enough.
+ */
+int extent_tree_allocate(ExtentTree *, int goal, int length);
+
+/**
+ * Finds where extent_tree_allocate would put @length positions without a goal, leaving the tree untouched.
+ * @return The first position, -1 if no extent is long enough.
+ */
+int extent_tree_find(ExtentTree *, int length);
+
+/**
+ * Puts positions back into the tree, merging them with the free extents on either side.
+ * @return 0 on success, -1 if an extent couldn't be allocated.
+ */
+int extent_tree_free(ExtentTree *, int start, int length);
+
+/**
+ * Returns the memory the tree takes up, in bytes.
+ */
+size_t extent_tree_bytes(ExtentTree *);
+
+#endif //ASSIGNMENT3_EXTENT_H
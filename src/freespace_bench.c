@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "extent.h"
+
+/**
+ * A microbenchmark of the two free space indexes an allocation group can keep: the bit map alone, and the free extent
+ * tree built over it with -o freetree. It fragments a bit map the size of a group, then times how long each index
+ * takes to find room for a 1 MiB contiguous file and how much memory each one needs.
+ *
+ * usage: freespace_bench [blocks] [block size] [percent used] [rounds]
+ */
+
+#define DEFAULT_BLOCKS 32768
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_PERCENT_USED 70
+#define DEFAULT_ROUNDS 1000
+
+/**
+ * The longest used or free run laid down while fragmenting the map.
+ */
+#define MAX_RUN 64
+
+/**
+ * Lays down alternating used and free runs of random length until the end of the map, so about @percentUsed of it is
+ * taken and the free space is split the way churn would leave it.
+ */
+static void fragment(BitMap *map, int bits, int percentUsed) {
+    srand(1); // The same map every run, so numbers can be compared across builds.
+
+    int position = 0;
+    while (position < bits) {
+        int used = 1 + rand() % (MAX_RUN * percentUsed / 50 + 1);
+        int free = 1 + rand() % (MAX_RUN * (100 - percentUsed) / 50 + 1);
+
+        for (; used > 0 && position < bits; used--, position++) {
+            bitmap_set(map, position);
+        }
+
+        position += free;
+    }
+}
+
+static long elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    int bits = argc > 1 ? atoi(argv[1]) : DEFAULT_BLOCKS;
+    int blockSize = argc > 2 ? atoi(argv[2]) : DEFAULT_BLOCK_SIZE;
+    int percentUsed = argc > 3 ? atoi(argv[3]) : DEFAULT_PERCENT_USED;
+    int rounds = argc > 4 ? atoi(argv[4]) : DEFAULT_ROUNDS;
+
+    if (bits <= 0 || blockSize <= 0 || percentUsed < 0 || percentUsed > 100 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [blocks] [block size] [percent used] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    BitMap *map = bitmap_allocate(bits);
+    if (!map) {
+        fprintf(stderr, "Could not allocate a bit map of %d blocks.\n", bits);
+        return 1;
+    }
+
+    // One hole that fits the file, three quarters of the way in, so the bit map has to scan for it.
+    int wanted = (1024 * 1024 + blockSize - 1) / blockSize;
+    fragment(map, bits, percentUsed);
+
+    int position = bits / 4 * 3;
+    for (; position < bits / 4 * 3 + wanted && position < bits; position++) {
+        bitmap_clear(map, position);
+    }
+
+    ExtentTree *tree = extent_tree_build(map);
+    if (!tree) {
+        fprintf(stderr, "Could not build the extent tree.\n");
+        bitmap_deallocate(map);
+        return 1;
+    }
+
+    int bitmapFound = -1, treeFound = -1;
+    struct timespec start, middle, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int round = 0;
+    for (; round < rounds; round++) {
+        bitmapFound = bitmap_find_zero_run(map, 0, wanted);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    for (round = 0; round < rounds; round++) {
+        treeFound = extent_tree_find(tree, wanted);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("blocks=%d block size=%d used=%d%% free=%ld in %d extents\n", bits, blockSize,
+           100 - (int) (tree->numFree * 100 / bits), tree->numFree, tree->numExtents);
+    printf("memory: bitmap=%zu bytes, extent tree=%zu bytes\n", bitmap_bytes(map), extent_tree_bytes(tree));
+    printf("1 MiB search (%d blocks): bitmap=%ld ns at %d, extent tree=%ld ns at %d\n", wanted,
+           elapsed(&start, &middle) / rounds, bitmapFound, elapsed(&middle, &end) / rounds, treeFound);
+
+    extent_tree_destroy(tree);
+    bitmap_deallocate(map);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "group.h"
+
+static AllocGroup groups[MAX_ALLOC_GROUPS];
+static int numGroups = 0;
+
+static int groupsFirstBlock = 0;
+static int groupBlocks = 0;
+
+static int nextHome = 0;
+static __thread int home = -1;
+
+int groups_init(BitMap *blockBitMap, int firstBlock, int useTree) {
+    int count = blockBitMap->bits / MIN_GROUP_BLOCKS;
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_ALLOC_GROUPS) {
+        count = MAX_ALLOC_GROUPS;
+    }
+
+    // Groups start on word boundaries so no two of them share a word of the bit map.
+    int size = (blockBitMap->bits + count - 1) / count;
+    size = (size + bitmap_wordlength - 1) / bitmap_wordlength * bitmap_wordlength;
+
+    int index = 0;
+    for (; index < count && index * size < blockBitMap->bits; index++) {
+        AllocGroup *group = groups + index;
+
+        int first = index * size;
+        int bits = first + size > blockBitMap->bits ? blockBitMap->bits - first : size;
+
+        group->map = bitmap_slice(blockBitMap, first, bits);
+        group->tree = NULL;
+        if (group->map && useTree) {
+            group->tree = extent_tree_build(group->map);
+        }
+
+        if (!group->map || (useTree && !group->tree)) {
+            fprintf(stderr, "Could not allocate group %d.\n", index);
+            numGroups = index;
+            groups_destroy();
+            return -1;
+        }
+
+        group->firstBlock = firstBlock + first;
+        group->numBlocks = bits;
+        group->numFreeBlocks = bits - bitmap_count_set(group->map);
+
+        pthread_mutex_init(&group->lock, NULL);
+    }
+
+    numGroups = index;
+    groupsFirstBlock = firstBlock;
+    groupBlocks = size;
+    return 0;
+}
+
+void groups_destroy() {
+    int index = 0;
+    for (; index < numGroups; index++) {
+        if (groups[index].tree) {
+            extent_tree_destroy(groups[index].tree);
+        }
+
+        bitmap_deallocate(groups[index].map);
+        pthread_mutex_destroy(&groups[index].lock);
+    }
+
+    numGroups = 0;
+}
+
+int group_count() {
+    return numGroups;
+}
+
+AllocGroup *group_get(int index) {
+    return groups + index;
+}
+
+AllocGroup *group_of(int block) {
+    if (numGroups == 0 || block < groupsFirstBlock) {
+        return NULL;
+    }
+
+    int index = (block - groupsFirstBlock) / groupBlocks;
+    if (index >= numGroups || block >= groups[index].firstBlock + groups[index].numBlocks) {
+        return NULL;
+    }
+
+    return groups + index;
+}
+
+long groups_free_blocks() {
+    long count = 0;
+
+    int index = 0;
+    for (; index < numGroups; index++) {
+        count += __atomic_load_n(&groups[index].numFreeBlocks, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+int groups_check_free() {
+    int repaired = 0;
+
+    int index = 0;
+    for (; index < numGroups; index++) {
+        AllocGroup *group = groups + index;
+
+        pthread_mutex_lock(&group->lock);
+
+        long counted = group->numBlocks - bitmap_count_set(group->map);
+        if (counted != group->numFreeBlocks) {
+            fprintf(stderr, "Group %d counts %ld free blocks but it's bit map has %ld, repairing.\n", index,
+                    group->numFreeBlocks, counted);
+            __atomic_store_n(&group->numFreeBlocks, counted, __ATOMIC_RELAXED);
+            repaired++;
+        }
+
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    return repaired;
+}
+
+int group_home() {
+    if (home < 0) {
+        home = __atomic_fetch_add(&nextHome, 1, __ATOMIC_RELAXED);
+    }
+
+    return numGroups > 0 ? home % numGroups : 0;
+}
@@ -0,0 +1,94 @@
+#ifndef ASSIGNMENT3_GROUP_H
+#define ASSIGNMENT3_GROUP_H
+
+#include <pthread.h>
+
+#include "bitmap.h"
+#include "extent.h"
+
+/**
+ * The most groups the data area is split into.
+ */
+#define MAX_ALLOC_GROUPS 8
+
+/**
+ * Groups are never made smaller than this many blocks, a small disk just gets fewer of them.
+ */
+#define MIN_GROUP_BLOCKS 1024
+
+/**
+ * A slice of the data area that is allocated from independently of the others.
+ */
+typedef struct {
+    /**
+     * The first data block of the group, as a block number.
+     */
+    int firstBlock;
+
+    int numBlocks;
+
+    /**
+     * The group's slice of the block bit map.
+     */
+    BitMap *map;
+
+    /**
+     * The group's free extents, NULL unless the free extent index was asked for. Kept alongside the bit map, which
+     * stays the copy that goes to disk.
+     */
+    ExtentTree *tree;
+
+    /**
+     * The group's shard of the free block count, changed under @lock but readable without it.
+     */
+    long numFreeBlocks;
+
+    pthread_mutex_t lock;
+} AllocGroup;
+
+/**
+ * Splits the block bit map into allocation groups, the bit map must already be loaded. With @useTree each group's
+ * free extents are also indexed in an extent tree, rebuilt from the bit map since it is never stored.
+ * @return 0 on success, -1 on failure.
+ */
+int groups_init(BitMap *blockBitMap, int firstBlock, int useTree);
+
+/**
+ * Releases the groups, the block bit map itself is left alone.
+ */
+void groups_destroy();
+
+/**
+ * Returns the number of groups.
+ */
+int group_count();
+
+/**
+ * Returns the group at @index.
+ */
+AllocGroup *group_get(int index);
+
+/**
+ * Returns the group holding @block, NULL if it isn't a data block.
+ */
+AllocGroup *group_of(int block);
+
+/**
+ * Sums the free block counts of every group, without taking any of their locks.
+ * @return The number of free data blocks.
+ */
+long groups_free_blocks();
+
+/**
+ * Recounts each group's free blocks from it's bit map and repairs the group's count where the two disagree.
+ * @return The number of groups that had to be repaired.
+ */
+int groups_check_free();
+
+/**
+ * Returns the index of the calling thread's home group. Threads are spread over the groups as they first allocate,
+ * so writers on different threads allocate without waiting on each other.
+ */
+int group_home();
+
+#endif //ASSIGNMENT3_GROUP_H
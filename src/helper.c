@@ -5,44 +5,133 @@
 #include "helper.h"
 #include "sfs.h"
 #include "bitmap.h"
+#include "blockmap.h"
 #include "bytebuffer.h"
+#include "group.h"
+#include "itable.h"
+
+/**
+ * Guards the i-node bit map together with the free i-node count.
+ */
+static pthread_mutex_t iNodeMapMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Serializes the super block's fields into the front of @buffer.
+ */
+static void serialize_super(Byte *buffer) {
+    ByteBuffer byteBuffer = {0, 0, buffer};
+
+    writeInt(&byteBuffer, SFS_MAGIC);
+    writeInt(&byteBuffer, (__uint32_t) BLOCK_SIZE);
+    // The groups hold the live count, the super block only keeps a copy of it for the disk.
+    superBlock->numFreeBlocks = groups_free_blocks();
+    writeInt(&byteBuffer, (__uint32_t) superBlock->numFreeBlocks);
+    writeInt(&byteBuffer, (__uint32_t) superBlock->numFreeINodes);
+    writeInt(&byteBuffer, (__uint32_t) superBlock->blockBitMap->numPartitions);
+
+    // The i-node bit map spans as many i-nodes as the table's chunks hold.
+    itable_serialize(&byteBuffer);
+}
+
+/**
+ * Queues every dirty chunk of @map to be written, one block each, starting at block @firstBlock of the region.
+ * @return The number of blocks queued behind @count.
+ */
+static int queue_dirty_bitmap(BitMap *map, int firstBlock, int *blocks, Byte *buffer, int count) {
+    int numChunks = bitmap_num_chunks(map);
+
+    int chunk = 0;
+    for (; chunk < numChunks; chunk++) {
+        if (!bitmap_take_dirty(map, chunk)) {
+            continue;
+        }
+
+        ByteBuffer byteBuffer = {0, 0, buffer + (size_t) count * BLOCK_SIZE};
+        memset(byteBuffer.buffer, 0, BLOCK_SIZE);
+
+        int partition = chunk * BITMAP_WORDS_PER_BLOCK;
+        int end = partition + BITMAP_WORDS_PER_BLOCK;
+        for (; partition < end && partition < map->numPartitions; partition++) {
+            writeInt(&byteBuffer, (__uint32_t) map->container[partition]);
+        }
+
+        blocks[count++] = firstBlock + chunk;
+    }
+
+    return count;
+}
 
 int flush_super() {
-    ByteBuffer *byteBuffer = allocate_n(BLOCK_SIZE);
-    if (!byteBuffer) {
-        fprintf(stderr, "Could not allocate byte buffer.\n");
+    static pthread_mutex_t superLock = PTHREAD_MUTEX_INITIALIZER;
+
+    int maxBlocks = NUM_SUPER_BLOCKS + NUM_BITMAP_BLOCKS;
+    Byte *buffer = (Byte *) malloc((size_t) maxBlocks * BLOCK_SIZE);
+    int *blocks = (int *) malloc(sizeof(int) * maxBlocks);
+    if (!buffer || !blocks) {
+        fprintf(stderr, "Could not allocate super block buffer.\n");
+        free(buffer);
+        free(blocks);
         return -1;
     }
 
-    writeInt(byteBuffer, (__uint32_t) superBlock->numFreeBlocks);
-    writeByte(byteBuffer, (__uint8_t) superBlock->numFreeINodes);
+    // Serialized so a flush that finds a chunk clean can't return before the flush that took it has written it.
+    pthread_mutex_lock(&superLock);
 
-    int numPartitions = superBlock->blockBitMap->numPartitions;
-    writeInt(byteBuffer, (__uint32_t) numPartitions);
-    for (; numPartitions >= 0; numPartitions--) {
-        writeInt(byteBuffer, superBlock->blockBitMap->container[numPartitions]);
-    }
+    memset(buffer, 0, BLOCK_SIZE);
+    serialize_super(buffer);
+    blocks[0] = SUPER_BLOCK_INDEX;
+
+    int count = queue_dirty_bitmap(superBlock->blockBitMap, BLOCK_BITMAP_START, blocks, buffer, NUM_SUPER_BLOCKS);
+
+    pthread_mutex_lock(&iNodeMapMutex); // The i-node bit map is swapped out as it grows.
+    count = queue_dirty_bitmap(superBlock->iNodeBitMap, INODE_BITMAP_START, blocks, buffer, count);
+    pthread_mutex_unlock(&iNodeMapMutex);
+
+    int retstat = block_writev(blocks, count, buffer, NULL);
+
+    pthread_mutex_unlock(&superLock);
+
+    free(buffer);
+    free(blocks);
+
+    return retstat < 0 ? -1 : 0;
+}
 
-    numPartitions = superBlock->iNodeBitMap->numPartitions;
-    writeInt(byteBuffer, (__uint32_t) numPartitions);
-    for (; numPartitions >= 0; numPartitions--) {
-        writeInt(byteBuffer, superBlock->iNodeBitMap->container[numPartitions]);
+/**
+ * Reads a bit map's partitions out of it's blocks of the bit map region.
+ */
+static void load_bitmap(BitMap *map, Byte *region) {
+    ByteBuffer byteBuffer = {0, map->numPartitions * 4, region};
+
+    int partition = 0;
+    for (; partition < map->numPartitions; partition++) {
+        map->container[partition] = (bitmap_type) readInt(&byteBuffer);
     }
 
-    if (block_write(SUPER_BLOCK_INDEX, byteBuffer->buffer) <= 0) {
+    bitmap_rebuild(map);
+}
+
+int load_super(Byte *buffer) {
+    ByteBuffer byteBuffer = {0, BLOCK_SIZE, buffer};
+
+    if (readInt(&byteBuffer) != SFS_MAGIC || readInt(&byteBuffer) != (__uint32_t) BLOCK_SIZE) {
         return -1;
     }
 
-    free(byteBuffer);
-    return 0;
-}
+    superBlock->numFreeBlocks = readInt(&byteBuffer);
+    superBlock->numFreeINodes = (int) readInt(&byteBuffer);
 
-int flush_iNode(INode *node) {
-    ByteBuffer *byteBuffer = allocate_n(BLOCK_SIZE);
-    if (!byteBuffer) {
+    if ((int) readInt(&byteBuffer) != superBlock->blockBitMap->numPartitions || itable_load(&byteBuffer) < 0
+        || bitmap_grow(superBlock->iNodeBitMap, itable_count()) < 0) {
         return -1;
     }
 
+    load_bitmap(superBlock->blockBitMap, buffer + (size_t) (BLOCK_BITMAP_START - SUPER_BLOCK_INDEX) * BLOCK_SIZE);
+    load_bitmap(superBlock->iNodeBitMap, buffer + (size_t) (INODE_BITMAP_START - SUPER_BLOCK_INDEX) * BLOCK_SIZE);
+    return 0;
+}
+
+static void serialize_iNode(INode *node, ByteBuffer *byteBuffer) {
     writeLong(byteBuffer, node->id);
     writeInt(byteBuffer, node->userId);
     writeInt(byteBuffer, node->groupId);
@@ -53,29 +142,145 @@ int flush_iNode(INode *node) {
     writeLong(byteBuffer, (size_t) node->numFileLinks);
     writeLong(byteBuffer, node->fileSize);
 
-    int index = 0;
-    int numBlockLinks = sizeof(node->blockLinks) / sizeof(short);
-    for (; index < numBlockLinks; index++) {
-        writeShort(byteBuffer, (__uint16_t) node->blockLinks[index]);
+    links_serialize(node, byteBuffer);
+
+    writeByte(byteBuffer, node->inlineData != NULL);
+    if (node->inlineData) {
+        memcpy(byteBuffer->buffer + INODE_HEADER_BYTES, node->inlineData, node->fileSize);
     }
+}
+
+int flush_iNode(INode *node) {
+    return flush_iNodes(&node, 1);
+}
 
-    if (block_write((const int) (INODE_BLOCK_START + node->id), byteBuffer->buffer) <= 0) {
+/**
+ * Serializes the records of the i-nodes in @nodes that share the table block of @nodes[first] over the block as it
+ * is on the disk.
+ * @return 0 on success, -1 if the block couldn't be read.
+ */
+static int serialize_table_block(INode **nodes, int first, int count, Byte *buffer) {
+    ino_t block = nodes[first]->id / INODES_PER_BLOCK;
+
+    if (block_read(itable_block_of(nodes[first]->id), buffer) <= 0) {
         return -1;
     }
 
-//    free(byteBuffer->buffer);
-    free(byteBuffer);
+    // Neighbours outside the batch keep their record from the disk, a change they haven't written yet is still dirty.
+    int index = first;
+    for (; index < count; index++) {
+        if (nodes[index]->id / INODES_PER_BLOCK != block) {
+            continue;
+        }
+
+        ByteBuffer byteBuffer = {0, 0, buffer + (size_t) (nodes[index]->id % INODES_PER_BLOCK) * INODE_RECORD_BYTES};
+        serialize_iNode(nodes[index], &byteBuffer);
+    }
 
     return 0;
 }
 
+int flush_iNodes(INode **nodes, int count) {
+    // Read, serialized and written under one lock, so a table block never goes out with an older copy of a neighbour.
+    static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+    // The extent, leaf or indirect blocks that changed go out in the same batch, right behind their i-node.
+    size_t maxBlocks = (size_t) count;
+
+    int index = 0;
+    for (; index < count; index++) {
+        maxBlocks += (size_t) links_dirty_blocks(nodes[index]);
+    }
+
+    Byte *buffer = (Byte *) calloc(maxBlocks, BLOCK_SIZE);
+    int *blocks = (int *) malloc(sizeof(int) * maxBlocks);
+    if (!buffer || !blocks) {
+        free(buffer);
+        free(blocks);
+        return -1;
+    }
+
+    pthread_mutex_lock(&tableLock);
+
+    int numBlocks = 0;
+    for (index = 0; index < count; index++) {
+        ino_t id = nodes[index]->id;
+
+        // Neighbours in the same batch share their table block, it's written once.
+        int previous = 0;
+        for (; previous < index && nodes[previous]->id / INODES_PER_BLOCK != id / INODES_PER_BLOCK; previous++);
+
+        if (previous == index) {
+            if (serialize_table_block(nodes, index, count, buffer + (size_t) numBlocks * BLOCK_SIZE) < 0) {
+                pthread_mutex_unlock(&tableLock);
+                free(buffer);
+                free(blocks);
+                return -1;
+            }
+
+            blocks[numBlocks++] = itable_block_of(id);
+        }
+
+        numBlocks += links_serialize_dirty(nodes[index], blocks + numBlocks, buffer + (size_t) numBlocks * BLOCK_SIZE);
+    }
+
+    int retstat = block_writev(blocks, numBlocks, buffer, NULL);
+
+    pthread_mutex_unlock(&tableLock);
+
+    free(buffer);
+    free(blocks);
+
+    return retstat < 0 ? -1 : 0;
+}
+
+void load_iNode(INode *node, Byte *buffer) {
+    ByteBuffer byteBuffer = {0, INODE_RECORD_BYTES, buffer};
+
+    node->id = (ino_t) readLong(&byteBuffer);
+    node->userId = (uid_t) readInt(&byteBuffer);
+    node->groupId = (gid_t) readInt(&byteBuffer);
+
+    node->st_mode = (mode_t) readInt(&byteBuffer);
+
+    node->lastFileModTime.tv_sec = readLong(&byteBuffer);
+    node->lastAccessTime.tv_sec = readLong(&byteBuffer);
+    node->lastModifiedTime.tv_sec = readLong(&byteBuffer);
+
+    node->numFileLinks = (nlink_t) readLong(&byteBuffer);
+    node->fileSize = (size_t) readLong(&byteBuffer);
+
+    if (links_load(node, &byteBuffer) < 0) {
+        fprintf(stderr, "Could not load the overflow extents of i-node %lu.\n", (unsigned long) node->id);
+    }
+
+    node->inlineData = NULL;
+    if (readByte(&byteBuffer) && node_inline(node) == 0) {
+        size_t size = node->fileSize < INLINE_DATA_BYTES ? node->fileSize : INLINE_DATA_BYTES;
+        memcpy(node->inlineData, buffer + INODE_HEADER_BYTES, size);
+    }
+}
+
+void format_iNodes(ino_t first, int count, Byte *buffer) {
+    INode node;
+
+    int index = 0;
+    for (; index < count; index++) {
+        node_stat(&node, first + index, S_IFREG | S_IRWXU, DEFAULT_NUM_DIRECTORIES);
+
+        ByteBuffer byteBuffer = {0, 0, buffer + (size_t) index * INODE_RECORD_BYTES};
+        serialize_iNode(&node, &byteBuffer);
+        links_release(&node);
+    }
+}
+
 INode *findINode(const char *absolutePath) {
     Directory *directory = findDirectory(rootDirectory, "", absolutePath);
     if (!directory) {
         return NULL;
     }
 
-    return iNodeList + directory->entry->ino;
+    return node_get(directory->entry->ino);
 }
 
 void node_stat(INode *node, ino_t id, mode_t st_mode, nlink_t numFileLinks) {
@@ -92,12 +297,15 @@ void node_stat(INode *node, ino_t id, mode_t st_mode, nlink_t numFileLinks) {
     if (node->id == ROOT_INODE_ID)
         fprintf(stderr, "ST_MODE: %u %d\n", node->st_mode, S_ISDIR(node->st_mode));
     node->numFileLinks = numFileLinks;
+    node->fileSize = 0;
+    node->inlineData = NULL;
 
-    int index = 0;
-    int numDataBlocks = sizeof(node->blockLinks) / sizeof(short);
-    for (; index < numDataBlocks; index++) {
-        node->blockLinks[index] = -1;
-    }
+    links_init(node);
+}
+
+int node_inline(INode *node) {
+    node->inlineData = (Byte *) calloc(1, INLINE_DATA_BYTES);
+    return node->inlineData ? 0 : -1;
 }
 
 int node_destroy(INode *node) {
@@ -105,24 +313,41 @@ int node_destroy(INode *node) {
         return EACCES; // Deny this operation.
     }
 
-    int position = 0;
-    int numLinks = sizeof(node->blockLinks) / sizeof(short);
-    for (; position < numLinks; position++) {
-        int block = node->blockLinks[position];
-        if (block == -1) {
-            continue;
+    int numBlocks = links_blocks(node, NULL);
+    if (numBlocks < 0) {
+        return EIO;
+    }
+
+    if (numBlocks > 0) {
+        int *blocks = (int *) malloc(sizeof(int) * numBlocks);
+        Byte *buffer = (Byte *) calloc((size_t) numBlocks, BLOCK_SIZE);
+        if (!blocks || !buffer) {
+            free(blocks);
+            free(buffer);
+            return ENOMEM;
         }
 
-        char buffer[BLOCK_SIZE];
-        memset(buffer, 0, BLOCK_SIZE);
+        links_blocks(node, blocks);
+
+        int retstat = block_writev(blocks, numBlocks, buffer, NULL); // Empty out those disk blocks!
+        free(buffer);
 
-        if (block_write(block, buffer) <= 0) { // Empty out those disk blocks!
+        if (retstat < 0) {
+            free(blocks);
             return EFAULT;
         }
 
-        block_unreserve(block);
+        int index = 0;
+        for (; index < numBlocks; index++) {
+            block_unreserve(blocks[index]);
+        }
+
+        free(blocks);
     }
 
+    links_release(node);
+    free(node->inlineData);
+
     //TODO destroy the directory entry as well!
 
     node_stat(node, node->id, S_IFREG | S_IRUSR | S_IWUSR | S_IXUSR, 0); // <--- no files are linked to it anymore
@@ -136,18 +361,41 @@ int node_destroy(INode *node) {
     return 0;
 }
 
+void node_discard(INode *node) {
+    int numBlocks = links_blocks(node, NULL);
+    if (numBlocks > 0) {
+        int *blocks = (int *) malloc(sizeof(int) * numBlocks);
+        if (blocks) {
+            links_blocks(node, blocks);
+
+            int index = 0;
+            for (; index < numBlocks; index++) {
+                block_unreserve(blocks[index]);
+            }
+
+            free(blocks);
+        }
+    }
+
+    links_release(node);
+    free(node->inlineData);
+
+    node_stat(node, node->id, S_IFREG | S_IRUSR | S_IWUSR | S_IXUSR, 0);
+    node_unreserve(node);
+}
+
 void node_reserve(INode *node) {
     BitMap *map = superBlock->iNodeBitMap;
     if (!map) {
         return;
     }
 
-    if (bitmap_get(map, (int) node->id)) { // If the node is already taken, we don't want to continue.
-        return;
+    pthread_mutex_lock(&iNodeMapMutex);
+    if (!bitmap_get(map, (int) node->id)) { // If the node is already taken, we don't want to continue.
+        bitmap_set(map, (int) node->id);
+        __atomic_sub_fetch(&superBlock->numFreeINodes, 1, __ATOMIC_RELAXED);
     }
-
-    bitmap_set(map, (int) node->id);
-    superBlock->numFreeINodes--;
+    pthread_mutex_unlock(&iNodeMapMutex);
 }
 
 void node_unreserve(INode *node) {
@@ -156,13 +404,34 @@ void node_unreserve(INode *node) {
         return;
     }
 
-    unsigned int position = (unsigned int) (node->id - INODE_BLOCK_START);
-    if (!bitmap_get(map, position)) {
-        return;
+    int position = (int) node->id;
+
+    pthread_mutex_lock(&iNodeMapMutex);
+    if (bitmap_get(map, position)) {
+        bitmap_clear(map, position);
+        __atomic_add_fetch(&superBlock->numFreeINodes, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&iNodeMapMutex);
+}
 
-    bitmap_clear(map, position);
-    superBlock->numFreeINodes++;
+int node_check_free() {
+    BitMap *map = superBlock->iNodeBitMap;
+    if (!map) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&iNodeMapMutex);
+
+    int counted = itable_count() - bitmap_count_set(map);
+    int repaired = counted != superBlock->numFreeINodes;
+    if (repaired) {
+        fprintf(stderr, "The super block counts %d free i-nodes but the bit map has %d, repairing.\n",
+                superBlock->numFreeINodes, counted);
+        __atomic_store_n(&superBlock->numFreeINodes, counted, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&iNodeMapMutex);
+    return repaired;
 }
 
 bool isReservedNode(INode *node) {
@@ -171,7 +440,41 @@ bool isReservedNode(INode *node) {
         return false;
     }
 
-    return (bool) bitmap_get(map, (int) node->id);
+    pthread_mutex_lock(&iNodeMapMutex);
+    bool reserved = (bool) bitmap_get(map, (int) node->id);
+    pthread_mutex_unlock(&iNodeMapMutex);
+
+    return reserved;
+}
+
+/**
+ * Adds a chunk to the i-node table and grows the bit map over it. Must be called with the i-node map mutex held.
+ * @return 0 on success, -1 if the table couldn't grow.
+ */
+static int grow_table() {
+    if (itable_grow() < 0) {
+        return -1;
+    }
+
+    if (bitmap_grow(superBlock->iNodeBitMap, itable_count()) < 0) {
+        fprintf(stderr, "Could not grow the i-node bit map to %d i-nodes.\n", itable_count());
+        return -1;
+    }
+
+    __atomic_add_fetch(&superBlock->numFreeINodes, INODES_PER_CHUNK, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int node_table_grow() {
+    pthread_mutex_lock(&iNodeMapMutex);
+    int retstat = grow_table();
+    pthread_mutex_unlock(&iNodeMapMutex);
+
+    if (retstat < 0 || flush_super() < 0) {
+        return -1;
+    }
+
+    return 0;
 }
 
 
@@ -179,38 +482,165 @@ ReserveBlock block_reserve(INode *node) {
     ReserveBlock reserveBlock;
 
     reserveBlock.nextDataBlock = -1;
-    reserveBlock.nextLink = -1;
+    reserveBlock.nextLink = nextFreeLink(node);
+    if (reserveBlock.nextLink == -1) {
+        return reserveBlock;
+    }
+
+    reserveBlock.nextDataBlock = block_reserve_link(node, reserveBlock.nextLink);
+    if (reserveBlock.nextDataBlock == -1) {
+        reserveBlock.nextLink = -1;
+    }
 
-    int nextDataBlock = nextFreeDataBlock();
+    return reserveBlock;
+}
+
+int block_reserve_link(INode *node, int link) {
+    if (link < 0 || link >= links_max(node)) {
+        return -1;
+    }
+
+    int length = 0;
+    int nextDataBlock = block_reserve_run(-1, 1, &length);
     if (nextDataBlock == -1) {
-        return reserveBlock;
+        return -1;
     }
 
-    int nextLink = nextFreeLink(node->blockLinks);
-    if (nextLink == -1) {
-        return reserveBlock;
+    // Link the given i-node to the block that we are reserving it for.
+    if (link_map(node, link, nextDataBlock, 1, false) < 0) {
+        block_unreserve(nextDataBlock);
+        return -1;
+    }
+
+    return nextDataBlock;
+}
+
+/**
+ * Reserves a run of exactly @wanted blocks inside one group, from @start (relative to the group) if there is room.
+ * @return The first reserved data block, -1 if the group has no such run.
+ */
+static int group_reserve(AllocGroup *group, int start, int wanted) {
+    pthread_mutex_lock(&group->lock);
+
+    BitMap *map = group->map;
+    if ((start < 0 || start >= map->bits) && !group->tree) {
+        start = map->cursor; // No preference, carry on where the last allocation left off.
+    }
+
+    int position = -1;
+    if (group->numFreeBlocks >= wanted) {
+        if (group->tree) {
+            position = extent_tree_allocate(group->tree, start, wanted); // Best fit when the goal has no room.
+        } else {
+            position = bitmap_find_zero_run(map, start, wanted);
+            if (position == -1 && start > map->lowestFree) {
+                position = bitmap_find_zero_run(map, map->lowestFree, wanted);
+            }
+        }
     }
 
-    reserveBlock.nextDataBlock = nextDataBlock;
-    reserveBlock.nextLink = nextLink;
+    if (position == -1) {
+        pthread_mutex_unlock(&group->lock);
+        return -1;
+    }
 
-    node->blockLinks[nextLink] = (short) nextDataBlock; // Link the given i-node to the block that we are reserving it for.
+    int index = 0;
+    for (; index < wanted; index++) {
+        bitmap_set(map, position + index);
+    }
 
-    bitmap_set(superBlock->blockBitMap, nextDataBlock - DATA_BLOCK_START);
-    superBlock->numFreeBlocks--;
-    return reserveBlock;
+    map->cursor = position + wanted < map->bits ? position + wanted : 0;
+    __atomic_sub_fetch(&group->numFreeBlocks, wanted, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&group->lock);
+    return group->firstBlock + position;
+}
+
+int block_reserve_run(int goal, int wanted, int *length) {
+    int numGroups = group_count();
+
+    // The goal's group comes first, then the thread's own group, then the rest in turn.
+    AllocGroup *goalGroup = group_of(goal);
+    int first = goalGroup ? (int) (goalGroup - group_get(0)) : group_home();
+
+    // Settle for shorter runs only once no group has a run of the wanted length.
+    for (; wanted > 0; wanted /= 2) {
+        int step = 0;
+        for (; step < numGroups; step++) {
+            AllocGroup *group = group_get((first + step) % numGroups);
+
+            int start = group == goalGroup ? goal - group->firstBlock : -1;
+            int block = group_reserve(group, start, wanted);
+            if (block != -1) {
+                *length = wanted;
+                return block;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int block_reserve_links(INode *node, int firstLink, int count, bool unwritten) {
+    int endLink = firstLink + count;
+    if (firstLink < 0 || endLink > links_max(node)) {
+        return -1;
+    }
+
+    int link = firstLink;
+    while (link < endLink) {
+        if (link_block(node, link) != -1) {
+            link++;
+            continue;
+        }
+
+        int wanted = 1;
+        while (link + wanted < endLink && link_block(node, link + wanted) == -1) {
+            wanted++;
+        }
+
+        // Aim right behind the closest block the file already has before this link.
+        int length = 0;
+        int block = block_reserve_run(link_goal(node, link), wanted, &length);
+        if (block == -1) {
+            return -1;
+        }
+
+        if (link_map(node, link, block, length, unwritten) < 0) {
+            int index = 0;
+            for (; index < length; index++) {
+                block_unreserve(block + index);
+            }
+            return -1;
+        }
+
+        link += length;
+    }
+
+    return 0;
 }
 
 void block_unreserve(int block) {
-    BitMap *map = superBlock->blockBitMap;
+    AllocGroup *group = group_of(block);
+    if (!group) {
+        return;
+    }
+
+    pthread_mutex_lock(&group->lock);
 
-    int position = block - DATA_BLOCK_START;
-    if (!bitmap_get(map, position)) {
+    int position = block - group->firstBlock;
+    if (!bitmap_get(group->map, position)) {
+        pthread_mutex_unlock(&group->lock);
         return;
     }
 
-    bitmap_clear(map, position);
-    superBlock->numFreeBlocks++;
+    bitmap_clear(group->map, position);
+    if (group->tree) {
+        extent_tree_free(group->tree, position, 1);
+    }
+    __atomic_add_fetch(&group->numFreeBlocks, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&group->lock);
 }
 
 Directory *directory_allocate(ino_t ino, const char *entryName) {
@@ -230,6 +660,7 @@ Directory *directory_allocate(ino_t ino, const char *entryName) {
 
     directory->child = NULL;
     directory->sibling = NULL;
+    directory->loaded = true; // A new entry has neither yet.
 
     return directory;
 
@@ -260,23 +691,35 @@ void *parseDirectory(void *lambda(Directory *, void *), Directory *directory, vo
 }
 
 void *saveDirectory(Directory *directory) { //TODO give access to super block to helper.c
+    if (directory_load(directory) < 0) {
+        return NULL; // Writing it unread would drop it's sibling and child.
+    }
+
     ByteBuffer *byteBuffer = allocate_n(BLOCK_SIZE);
     if (!byteBuffer) {
         return NULL;
     }
 
     writeString(byteBuffer, directory->entry->entryName);
-    writeShort(byteBuffer, (__uint16_t) directory->entry->ino);
+    writeInt(byteBuffer, (__uint32_t) directory->entry->ino);
 
     _Bool siblingExists = directory->sibling ? true : false;
     _Bool childExists = directory->child ? true : false;
 
-    writeShort(byteBuffer, (__uint16_t) (siblingExists ? directory->sibling->entry->ino : -1));
-    writeShort(byteBuffer, (__uint16_t) (childExists ? directory->child->entry->ino : -1));
+    writeInt(byteBuffer, siblingExists ? (__uint32_t) directory->sibling->entry->ino : NO_DIRECTORY_ENTRY);
+    writeInt(byteBuffer, childExists ? (__uint32_t) directory->child->entry->ino : NO_DIRECTORY_ENTRY);
+
+    INode *node = node_get(directory->entry->ino);
+    if (!node) {
+        return NULL;
+    }
 
-    INode *node = iNodeList + directory->entry->ino;
+    node_lock(node);
+    int written = block_write(link_block(node, DIRECTORY_LINK), byteBuffer->buffer);
+    node_unlock(node);
+    node_put(node);
 
-    if (block_write(node->blockLinks[0], byteBuffer->buffer) <= 0) {
+    if (written <= 0) {
         return NULL;
     }
 
@@ -285,31 +728,29 @@ void *saveDirectory(Directory *directory) { //TODO give access to super block to
     return NULL;
 }
 
-void *loadDirectory(Directory *directory) {
+int loadDirectory(Directory *directory) {
     DirectoryEntry *entry = directory->entry;
 
-    _Bool root = !entry ? true : false;
-    if (root) {
-        entry = directory->entry = (DirectoryEntry *) malloc(sizeof(DirectoryEntry));
-        if (!entry) {
-            return NULL;
-        }
+    char buffer[BLOCK_SIZE];
+    memset(buffer, 0, BLOCK_SIZE);
 
-        entry->ino = ROOT_INODE_ID;
-        _strcpy(entry->entryName, "/");
+    INode *node = node_get(entry->ino);
+    if (!node) {
+        return -1;
     }
 
-    char buffer[BLOCK_SIZE];
-    memset(buffer, 0, BLOCK_SIZE);
+    node_lock(node);
+    int read = block_read(link_block(node, DIRECTORY_LINK), buffer);
+    node_unlock(node);
+    node_put(node);
 
-    INode *node = iNodeList + entry->ino;
-    if (!node || block_read(node->blockLinks[0], buffer) <= 0) {
-        return NULL;
+    if (read <= 0) {
+        return -1;
     }
 
     ByteBuffer *byteBuffer = allocate((Byte *) buffer, 0, BLOCK_SIZE);
     if (!byteBuffer) {
-        return NULL;
+        return -1;
     }
 
     char *entryName = readString(byteBuffer);
@@ -317,32 +758,46 @@ void *loadDirectory(Directory *directory) {
         _strcpy(entry->entryName, entryName);
         free(entryName);
     }
-    entry->ino = (ino_t) readShort(byteBuffer);
+    entry->ino = (ino_t) readInt(byteBuffer);
 
-    short sibling_ino = readShort(byteBuffer);
-    if (sibling_ino != -1) {
+    __uint32_t sibling_ino = readInt(byteBuffer);
+    if (sibling_ino != NO_DIRECTORY_ENTRY) {
         Directory *sibling = directory->sibling = directory_allocate(sibling_ino, "");
         if (!sibling) {
-            return NULL;
+            return -1;
         }
 
         sibling->entry->ino = (ino_t) sibling_ino;
+        sibling->loaded = false;
     }
 
-    short child_ino = readShort(byteBuffer);
-    if (child_ino != -1) {
+    __uint32_t child_ino = readInt(byteBuffer);
+    if (child_ino != NO_DIRECTORY_ENTRY) {
         Directory *child = directory->child = directory_allocate(child_ino, "");
         if (!child) {
-            return NULL;
+            return -1;
         }
 
         child->entry->ino = (ino_t) child_ino;
+        child->loaded = false;
     }
 
     free(byteBuffer->buffer);
     free(byteBuffer);
 
-    return NULL;
+    directory->loaded = true;
+    return 0;
+}
+
+int directory_load(Directory *directory) {
+    // Lookups can reach the same entry at once, it's only read by the first.
+    static pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&loadLock);
+    int retstat = directory->loaded ? 0 : loadDirectory(directory);
+    pthread_mutex_unlock(&loadLock);
+
+    return retstat;
 }
 
 Directory *findParentDirectory(Directory *directory, const char *absolutePath) {
@@ -350,12 +805,7 @@ Directory *findParentDirectory(Directory *directory, const char *absolutePath) {
 }
 
 Directory *findDirectory(Directory *directory, char *relativePath, const char *absolutePath) {
-    if (!directory) {
-        return NULL;
-    }
-
-    INode *node = iNodeList + directory->entry->ino;
-    if (!node) {
+    if (!directory || directory_load(directory) < 0) {
         return NULL;
     }
 
@@ -394,40 +844,62 @@ Directory *findLastSibling(Directory *parent) {
         return NULL; // Means that there is no child.
     }
 
-    for (; child->sibling; child = child->sibling);
+    // An entry that can't be read is treated as the last, it's sibling is never overwritten unread.
+    for (; directory_load(child) == 0 && child->sibling; child = child->sibling);
 
     return child;
 }
 
-int nextFreeLink(const short links[]) {
-    int position = 0;
-    size_t numLinks = sizeof(links);
-    for (; position < numLinks; position++) {
-        int id = links[position];
-        if (id == -1)
-            return position;
-    }
-
-    return -1;
+int nextFreeLink(INode *node) {
+    return links_first_hole(node);
 }
 
 int nextFreeBit(BitMap *map) {
-    int position = 0;
-    for (; position < map->bits; position++) {
-        if (!bitmap_get(map, position)) {
-            return position;
-        }
-    }
-
-    return -1;
+    return bitmap_next_free(map);
 }
 
 ino_t nextFreeINode() {
-    return (ino_t) nextFreeBit(superBlock->iNodeBitMap);
+    pthread_mutex_lock(&iNodeMapMutex);
+
+    int position = nextFreeBit(superBlock->iNodeBitMap);
+
+    // Every i-node is taken, so the table grows by a chunk. The chunk index lives in the super block.
+    bool grown = false;
+    if (position == -1 && grow_table() == 0) {
+        grown = true;
+        position = nextFreeBit(superBlock->iNodeBitMap);
+    }
+
+    pthread_mutex_unlock(&iNodeMapMutex);
+
+    if (grown && flush_super() < 0) {
+        return (ino_t) -1;
+    }
+
+    return (ino_t) position;
 }
 
-unsigned short nextFreeDataBlock() {
-    return (unsigned short) (nextFreeBit(superBlock->blockBitMap) + DATA_BLOCK_START);
+int nextFreeDataBlock() {
+    int numGroups = group_count();
+    int first = group_home();
+
+    int step = 0;
+    for (; step < numGroups; step++) {
+        AllocGroup *group = group_get((first + step) % numGroups);
+
+        pthread_mutex_lock(&group->lock);
+        int position = bitmap_find_first_zero(group->map, group->map->cursor);
+        if (position == -1) {
+            position = bitmap_find_first_zero(group->map, group->map->lowestFree);
+        }
+        pthread_mutex_unlock(&group->lock);
+
+        if (position != -1) {
+            return group->firstBlock + position;
+        }
+    }
+
+    return -1;
 }
 
 const char *strTruncDelim(const char *absolutePath) {
@@ -38,9 +38,25 @@
 #define ALLOCATION_BYTES 16777216
 
 /**
- * The minimum number of i-nodes to be allocated.
+ * Bytes of one i-node record in the table, the fields and link map up front and the inline data behind them.
  */
-#define NUM_INODE_BLOCKS 0x80
+#define INODE_RECORD_BYTES 256
+
+/**
+ * The number of i-node records packed into one table block.
+ */
+#define INODES_PER_BLOCK ((int) (BLOCK_SIZE / INODE_RECORD_BYTES))
+
+/**
+ * The number of consecutive blocks in a chunk of the i-node table, 32K worth. Chunks are taken from the data blocks
+ * as the table grows.
+ */
+#define INODE_CHUNK_BLOCKS (BLOCK_SIZE < 32768 ? 32768 / BLOCK_SIZE : 1)
+
+/**
+ * The number of i-nodes one chunk of the table holds.
+ */
+#define INODES_PER_CHUNK (INODE_CHUNK_BLOCKS * INODES_PER_BLOCK)
 
 /**
  * Block size adjusted by the metadata of the block.
@@ -52,7 +68,106 @@
  */
 #define NUM_TOTAL_BLOCKS ALLOCATION_BYTES / ADJUSTED_BLOCK_SIZE
 
-#define NUM_DATA_BLOCKS (NUM_TOTAL_BLOCKS - NUM_INODE_BLOCKS - 1)
+/**
+ * Identifies a formatted disk, it's the first thing in the super block. Bumped whenever the layout on the disk changes.
+ */
+#define SFS_MAGIC 0x53465335
+
+/**
+ * Bytes of the super block ahead of the chunk index: magic, block size, the free counts, the partition count of the
+ * block bit map and the number of i-node table chunks.
+ */
+#define SUPER_BLOCK_BYTES 24
+
+/**
+ * The most chunks the i-node table can grow to, the super block lists where each one starts.
+ */
+#define MAX_INODE_CHUNKS ((int) ((BLOCK_SIZE - SUPER_BLOCK_BYTES) / 4))
+
+/**
+ * The most i-nodes the table can grow to.
+ */
+#define MAX_INODES (MAX_INODE_CHUNKS * INODES_PER_CHUNK)
+
+/**
+ * The super block always fits in one block, the bit maps live in their own region behind it.
+ */
+#define NUM_SUPER_BLOCKS 1
+
+/**
+ * How many 32 bit bit map partitions one block of the bit map region holds.
+ */
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / 4)
+
+/**
+ * The number of blocks the data block bit map spans, sized for every block of the disk so it never depends on itself.
+ */
+#define NUM_BLOCK_BITMAP_BLOCKS ((int) (((NUM_TOTAL_BLOCKS + 31) / 32 + BITMAP_WORDS_PER_BLOCK - 1) / BITMAP_WORDS_PER_BLOCK))
+
+/**
+ * The number of blocks the i-node bit map spans, sized for the table at it's largest.
+ */
+#define NUM_INODE_BITMAP_BLOCKS ((int) (((MAX_INODES + 31) / 32 + BITMAP_WORDS_PER_BLOCK - 1) / BITMAP_WORDS_PER_BLOCK))
+
+#define NUM_BITMAP_BLOCKS (NUM_BLOCK_BITMAP_BLOCKS + NUM_INODE_BITMAP_BLOCKS)
+
+#define NUM_DATA_BLOCKS (NUM_TOTAL_BLOCKS - NUM_SUPER_BLOCKS - NUM_BITMAP_BLOCKS)
+
+/**
+ * The most links a file can have, links are mapped as extents so this only bounds the file size.
+ */
+#define MAX_FILE_LINKS 0x10000000
+
+/**
+ * The number of extents held in the i-node itself, the rest overflow into leaf blocks listed by an extent block.
+ */
+#define INODE_EXTENTS 4
+
+/**
+ * Bytes of an extent on the disk: the first link, the first block and the length, with the unwritten flag on top.
+ */
+#define EXTENT_BYTES 12
+
+/**
+ * The number of extents a leaf block holds.
+ */
+#define LEAF_EXTENTS ((int) (BLOCK_SIZE / EXTENT_BYTES))
+
+/**
+ * The most leaf blocks an extent block lists.
+ */
+#define MAX_EXTENT_LEAVES 64
+
+/**
+ * The number of links an indirectly mapped i-node points at straight from the i-node, enough for small files.
+ */
+#define INODE_DIRECT_LINKS 12
+
+/**
+ * The block pointers of an indirectly mapped i-node: the direct ones, then the single, double and triple indirect
+ * blocks.
+ */
+#define INODE_POINTERS (INODE_DIRECT_LINKS + 3)
+
+/**
+ * The bytes of an i-node record ahead of it's inline data, the fields and the link map fit in them.
+ */
+#define INODE_HEADER_BYTES 128
+
+/**
+ * The most bytes of file data an i-node record holds inline, a file only gets data blocks once it outgrows them.
+ */
+#define INLINE_DATA_BYTES ((size_t) (INODE_RECORD_BYTES - INODE_HEADER_BYTES))
+
+/**
+ * The link holding the i-node's directory entry, file data is linked after it.
+ */
+#define DIRECTORY_LINK 0
+
+/**
+ * The link holding the first block of file data.
+ */
+#define FIRST_DATA_LINK (DIRECTORY_LINK + 1)
 
 /**
  * The position of the super block.
@@ -65,9 +180,14 @@
 #define ROOT_INODE_ID 0
 
 /**
- * The position of the first i-node.
+ * The position of the first block of the data block bit map, right behind the super block.
+ */
+#define BLOCK_BITMAP_START (SUPER_BLOCK_INDEX + NUM_SUPER_BLOCKS)
+
+/**
+ * The position of the first block of the i-node bit map.
  */
-#define INODE_BLOCK_START 1
+#define INODE_BITMAP_START (BLOCK_BITMAP_START + NUM_BLOCK_BITMAP_BLOCKS)
 
 /**
  * The default number of directories for the file system.
@@ -77,12 +197,26 @@
 /**
  * The position of the first data block.
  */
-#define DATA_BLOCK_START (INODE_BLOCK_START + NUM_INODE_BLOCKS)
+#define DATA_BLOCK_START (INODE_BITMAP_START + NUM_INODE_BITMAP_BLOCKS)
 
 typedef struct timespec timestruc_t;
 
 typedef char *Block;
 
+/**
+ * A run of @length links from @link on, mapped to as many consecutive data blocks from @block on.
+ */
+typedef struct {
+    int link;
+    int block;
+    int length;
+
+    /**
+     * Set while the blocks were preallocated but never written, so they read back as zeroes.
+     */
+    _Bool unwritten;
+} LinkExtent;
+
 /**
  * I-node contains: owner, type (directory, file, device), last modified
  * time, last accessed time, last I-node modified time, access
@@ -136,9 +270,35 @@ typedef struct {
     size_t fileSize;
 
     /**
-     * The list of blocks to support.
+     * Whether the links are mapped by block pointers and indirect blocks rather than by extents.
+     */
+    _Bool indirect;
+
+    /**
+     * The block pointers when the links are mapped indirectly, 0 for a hole and the top bit set while unwritten.
+     */
+    __uint32_t pointers[INODE_POINTERS];
+
+    /**
+     * The number of extents mapping the i-node's links, sorted by link and never overlapping.
      */
-    short blockLinks[200];
+    int numExtents;
+
+    /**
+     * The first extents, the only ones most files ever need.
+     */
+    LinkExtent extents[INODE_EXTENTS];
+
+    /**
+     * The extents past the first INODE_EXTENTS and the blocks they're stored in, NULL until a file needs them.
+     */
+    struct ExtentOverflow *overflow;
+
+    /**
+     * The file's data while it's small enough to be stored in the i-node record, INLINE_DATA_BYTES long with the bytes
+     * past the file size zeroed. NULL once the data lives in data blocks.
+     */
+    Byte *inlineData;
 } INode;
 
 /**
@@ -165,9 +325,9 @@ typedef struct {
     long numFreeBlocks;
 
     /**
-     * Number of free I-nodes
+     * Number of free I-nodes in the chunks the table has so far.
      */
-    short numFreeINodes;
+    int numFreeINodes;
 } SuperBlock;
 
 /**
@@ -188,6 +348,11 @@ typedef struct {//TODO the length of an entry's name is the strlen + the zero op
     char entryName[NAME_MAX];
 } DirectoryEntry;
 
+/**
+ * Stands in for a missing sibling or child in a directory entry's block, where i-node numbers are 32 bits wide.
+ */
+#define NO_DIRECTORY_ENTRY 0xFFFFFFFFu
+
 /**
  * Contains a list of (entry name, inode number) pair
  */
@@ -212,6 +377,12 @@ typedef struct Directory { //TODO this structure requires marshaling as it uses
      * The next child of this directory.
      */
     struct Directory *child;
+
+    /**
+     * Whether it's sibling and child were read from it's block yet. Only the root is read at mount, every other entry
+     * is read the first time a lookup reaches it.
+     */
+    _Bool loaded;
 } Directory;
 
 typedef struct {
@@ -228,30 +399,49 @@ Directory *rootDirectory;
  */
 SuperBlock *superBlock; //TODO we need to synchro
 
-/**
- * Array of i'nodes. Pointer to the first i-node in the list.
- */
-INode *iNodeList;
-
 /**
  * Mutex for the sfs_init method.
  */
 pthread_mutex_t init_mutex;
 
 /**
- * Given a super block, write it's disk block.
+ * Given a super block, write it's disk block along with only the bit map blocks changed since the last flush.
  * @return If the super block was sucessfully written.
  */
 int flush_super();
 
 /**
- * Given an i-node, write it's disk block.
+ * Given the super block's disk block followed by the bit map region, populate the super block from them.
+ * @return 0 on success, -1 if the blocks don't hold a super block.
+ */
+int load_super(Byte *);
+
+/**
+ * Given an i-node, rewrite the table block holding it's record. The records of it's neighbours are kept as they are on
+ * the disk. Must be called with the i-node's lock held.
  * @return If the disk block was sucessfully written.
  */
 int flush_iNode(INode *);
 
 /**
- * Given a path, find the current i-node.
+ * Given a list of i-nodes, rewrite the table blocks holding them in one batch, each block once. Must be called with
+ * every one of their locks held.
+ * @return If every disk block was sucessfully written.
+ */
+int flush_iNodes(INode **, int);
+
+/**
+ * Given an i-node's record in the table, populate the i-node from it.
+ */
+void load_iNode(INode *, Byte *);
+
+/**
+ * Fills @buffer with the records of @count unused i-nodes numbered from @first on, for a new part of the table.
+ */
+void format_iNodes(ino_t first, int count, Byte *buffer);
+
+/**
+ * Given a path, find the current i-node and hold it, it's put back with node_put.
  * @return The i-node linked to this path.
  */
 INode *findINode(const char *);
@@ -261,11 +451,23 @@ INode *findINode(const char *);
  */
 void node_stat(INode *, ino_t, mode_t, nlink_t);
 
+/**
+ * Starts an empty i-node out with it's data inline.
+ * @return 0 on success, -1 if the inline buffer couldn't be allocated.
+ */
+int node_inline(INode *);
+
 /**
  * Destroys the entire node, it's block-list and it's directory.
  */
 int node_destroy(INode *node);
 
+/**
+ * Undoes a new i-node that never made it into a directory: gives back it's blocks and it's place in the i-node bit
+ * map, in memory only. The bit maps go out with the next flush.
+ */
+void node_discard(INode *node);
+
 /**
  * Reserves the i-node.
  */
@@ -276,12 +478,44 @@ void node_reserve(INode *);
  */
 void node_unreserve(INode *);
 
+/**
+ * Recounts the reserved i-nodes from the i-node bit map and repairs the free i-node count if the two disagree.
+ * @return 1 if the count had to be repaired, 0 otherwise.
+ */
+int node_check_free();
+
+/**
+ * Adds a chunk of i-nodes to the table, growing the i-node bit map and free count with it.
+ * @return 0 on success, -1 if the table couldn't grow or the super block couldn't be written.
+ */
+int node_table_grow();
+
 /**
  * Reserves a data block.
  * @return 0 on success, -1 on failure.
  */
 ReserveBlock block_reserve(INode *);
 
+/**
+ * Reserves a data block for the given link of the i-node.
+ * @return The reserved data block, -1 on failure.
+ */
+int block_reserve_link(INode *, int);
+
+/**
+ * Reserves a run of up to @wanted contiguous data blocks, starting at @goal if it's free, or at the block bit map's
+ * cursor when @goal is -1. When no run that long is left, the longest run found by halving @wanted is taken instead.
+ * @return The first reserved data block, -1 if the disk is full. @length gets the number of blocks reserved.
+ */
+int block_reserve_run(int goal, int wanted, int *length);
+
+/**
+ * Reserves data blocks for every unlinked link from @firstLink on, in as few runs as possible and placed right
+ * behind the blocks the i-node already has. They are mapped as @unwritten.
+ * @return 0 on success, -1 if the disk filled up or the i-node can't map any more extents.
+ */
+int block_reserve_links(INode *, int firstLink, int count, _Bool unwritten);
+
 /**
  * Release the data block from the bitmap.
  */
@@ -308,10 +542,17 @@ Directory *directory_allocate(ino_t, const char *);
 void *parseDirectory(void *(Directory *, void *), Directory *, void *extra);
 
 /**
- * Gets the directory's information from the specified block. TODO maybe an i-node parameter?
- * @return
+ * Gets the directory's information from the specified block. It's sibling and child are left unread until
+ * directory_load reaches them.
+ * @return 0 on success, -1 if the block couldn't be read.
+ */
+int loadDirectory(Directory *);
+
+/**
+ * Reads a directory's entry with loadDirectory the first time it's reached, so the tree is read as it's looked up.
+ * @return 0 once it's read, -1 if it couldn't be.
  */
-void *loadDirectory(Directory *);
+int directory_load(Directory *);
 
 /**
  * Save the given directory.
@@ -340,25 +581,25 @@ Directory *findLastSibling(Directory *);
  * Returns the next free i-node link.
  * @return The next i-node link.
  */
-int nextFreeLink(const short[]);
+int nextFreeLink(INode *);
 
 /**
- * Returns the next free position for a given bit map.
- * @return The position that's free.
+ * Returns the next free position for a given bit map, searching on from the last one handed out.
+ * @return The position that's free, -1 if the bit map is full.
  */
 int nextFreeBit(BitMap *);
 
 /**
- * Returns the next free i-node position.
- * @return The next free i-node position.
+ * Returns the next free i-node position, growing the i-node table by a chunk when every i-node is taken.
+ * @return The next free i-node position, -1 if the table is full and can't grow.
  */
 ino_t nextFreeINode();
 
 /**
  * Returns the next free data block position.
- * @return The next free data block position.
+ * @return The next free data block position, -1 if the disk is full.
  */
-unsigned short nextFreeDataBlock();
+int nextFreeDataBlock();
 
 /**
  * Truncates the string's end delimiter subset.
@@ -0,0 +1,561 @@
+#include "indirect.h"
+
+/**
+ * Set on a data block pointer while the block was preallocated but never written.
+ */
+#define POINTER_UNWRITTEN 0x80000000u
+
+/**
+ * The number of block pointers an indirect block holds.
+ */
+#define POINTERS_PER_BLOCK ((int) (BLOCK_SIZE / 4))
+
+/**
+ * The number of indirect blocks kept decoded, enough for the paths down to a few files' current blocks.
+ */
+#define INDIRECT_CACHE_SLOTS 64
+
+/**
+ * A decoded indirect block. Changes stay in the slot until the i-node is flushed or the slot is reused.
+ */
+typedef struct {
+    /**
+     * The indirect block held, 0 while the slot is empty since block 0 is the super block.
+     */
+    int block;
+
+    /**
+     * The i-node the block belongs to, it's written back along with it.
+     */
+    INode *node;
+
+    __uint32_t *pointers;
+    bool dirty;
+
+    /**
+     * Set on every use and cleared as the clock hand passes, only slots not used for a whole turn are reused.
+     */
+    bool referenced;
+
+    /**
+     * Set on a parent while the block below it is looked up, the clock hand passes it by so the parent's pointers
+     * stay put.
+     */
+    bool pinned;
+} IndirectSlot;
+
+static IndirectSlot slots[INDIRECT_CACHE_SLOTS];
+static int clockHand = 0;
+
+static pthread_mutex_t indirect_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void encode(IndirectSlot *slot, Byte *buffer) {
+    ByteBuffer byteBuffer = {0, 0, buffer};
+
+    int index = 0;
+    for (; index < POINTERS_PER_BLOCK; index++) {
+        writeInt(&byteBuffer, slot->pointers[index]);
+    }
+}
+
+static int write_back(IndirectSlot *slot) {
+    if (!slot->dirty) {
+        return 0;
+    }
+
+    Byte buffer[BLOCK_SIZE];
+    encode(slot, buffer);
+    if (block_write(slot->block, buffer) <= 0) {
+        fprintf(stderr, "Could not write back indirect block %d.\n", slot->block);
+        return -1;
+    }
+
+    slot->dirty = false;
+    return 0;
+}
+
+/**
+ * Finds the slot holding @block, reading the block into the next slot the clock hand gives up if it isn't cached. A
+ * @fresh block was just reserved, it starts out empty instead of being read.
+ * @return The slot, NULL if the block couldn't be read or the slot's old block couldn't be written back.
+ */
+static IndirectSlot *get_slot(INode *node, int block, bool fresh) {
+    IndirectSlot *slot = NULL;
+
+    int index = 0;
+    for (; index < INDIRECT_CACHE_SLOTS; index++) {
+        if (slots[index].block == block) {
+            slot = slots + index;
+            break;
+        }
+    }
+
+    if (!slot) {
+        for (;;) {
+            slot = slots + clockHand;
+            clockHand = (clockHand + 1) % INDIRECT_CACHE_SLOTS;
+            if (slot->pinned) {
+                continue;
+            }
+
+            if (!slot->referenced) {
+                break;
+            }
+
+            slot->referenced = false;
+        }
+
+        if (write_back(slot) < 0) {
+            return NULL;
+        }
+
+        if (!slot->pointers) {
+            slot->pointers = (__uint32_t *) malloc((size_t) BLOCK_SIZE);
+            if (!slot->pointers) {
+                return NULL;
+            }
+        }
+
+        slot->block = 0;
+        if (!fresh) {
+            Byte buffer[BLOCK_SIZE];
+            if (block_read(block, buffer) <= 0) {
+                return NULL;
+            }
+
+            ByteBuffer byteBuffer = {0, BLOCK_SIZE, buffer};
+            for (index = 0; index < POINTERS_PER_BLOCK; index++) {
+                slot->pointers[index] = readInt(&byteBuffer);
+            }
+        }
+
+        slot->block = block;
+        slot->node = node;
+        slot->dirty = false;
+    }
+
+    if (fresh) {
+        memset(slot->pointers, 0, (size_t) BLOCK_SIZE);
+        slot->dirty = true;
+    }
+
+    slot->referenced = true;
+    return slot;
+}
+
+/**
+ * Splits @link into the i-node pointer it's under, then the index into each indirect block on the way down.
+ * @return The number of indirect blocks on the way, -1 if the link is past the triple indirect block's reach.
+ */
+static int path_of(int link, int offsets[4]) {
+    if (link < INODE_DIRECT_LINKS) {
+        offsets[0] = link;
+        return 0;
+    }
+
+    long long remaining = link - INODE_DIRECT_LINKS;
+    long long span = POINTERS_PER_BLOCK;
+
+    int depth = 1;
+    for (; depth <= 3; depth++, span *= POINTERS_PER_BLOCK) {
+        if (remaining >= span) {
+            remaining -= span;
+            continue;
+        }
+
+        offsets[0] = INODE_DIRECT_LINKS + depth - 1;
+
+        int level = depth;
+        for (; level >= 1; level--) {
+            offsets[level] = (int) (remaining % POINTERS_PER_BLOCK);
+            remaining /= POINTERS_PER_BLOCK;
+        }
+
+        return depth;
+    }
+
+    return -1;
+}
+
+/**
+ * Finds the pointer of @link, reserving the indirect blocks on the way down near @goal when @create is set. Must be
+ * called with the indirect mutex held, and the pointer is only good until the next slot is looked up.
+ * @param slot Set to the slot holding the pointer, NULL when the i-node holds it itself.
+ * @return The pointer, NULL if the link is out of reach, or the way down hits a hole without @create or an error.
+ */
+static __uint32_t *find_pointer(INode *node, int link, bool create, int goal, IndirectSlot **slot) {
+    int offsets[4];
+    int depth = path_of(link, offsets);
+    if (depth < 0) {
+        return NULL;
+    }
+
+    __uint32_t *pointer = node->pointers + offsets[0];
+    *slot = NULL;
+
+    int level = 1;
+    for (; level <= depth; level++) {
+        bool fresh = *pointer == 0;
+        if (fresh) {
+            if (!create) {
+                return NULL;
+            }
+
+            int length = 0;
+            int block = block_reserve_run(goal, 1, &length);
+            if (block == -1) {
+                return NULL;
+            }
+
+            *pointer = (__uint32_t) block;
+            if (*slot) {
+                (*slot)->dirty = true;
+            }
+        }
+
+        // The parent is pinned, so the lookup can't hand it's slot to another block while @pointer points into it.
+        if (*slot) {
+            (*slot)->pinned = true;
+        }
+        IndirectSlot *next = get_slot(node, (int) (*pointer & ~POINTER_UNWRITTEN), fresh);
+        if (*slot) {
+            (*slot)->pinned = false;
+        }
+
+        if (!next) {
+            if (fresh) {
+                block_unreserve((int) *pointer);
+                *pointer = 0;
+                if (*slot) {
+                    (*slot)->dirty = true;
+                }
+            }
+            return NULL;
+        }
+
+        *slot = next;
+        pointer = next->pointers + offsets[level];
+    }
+
+    return pointer;
+}
+
+static int block_of(INode *node, int link) {
+    IndirectSlot *slot;
+    __uint32_t *pointer = find_pointer(node, link, false, -1, &slot);
+
+    return pointer && *pointer ? (int) (*pointer & ~POINTER_UNWRITTEN) : -1;
+}
+
+void indirect_init(INode *node) {
+    memset(node->pointers, 0, sizeof(node->pointers));
+}
+
+void indirect_release(INode *node) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    int index = 0;
+    for (; index < INDIRECT_CACHE_SLOTS; index++) {
+        if (slots[index].block != 0 && slots[index].node == node) {
+            slots[index].block = 0;
+            slots[index].dirty = false;
+            slots[index].referenced = false;
+        }
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+}
+
+int indirect_max_links() {
+    long long maxLinks = INODE_DIRECT_LINKS;
+    long long span = POINTERS_PER_BLOCK;
+
+    int depth = 1;
+    for (; depth <= 3 && maxLinks < MAX_FILE_LINKS; depth++, span *= POINTERS_PER_BLOCK) {
+        maxLinks += span;
+    }
+
+    return maxLinks < MAX_FILE_LINKS ? (int) maxLinks : MAX_FILE_LINKS;
+}
+
+int indirect_block(INode *node, int link) {
+    pthread_mutex_lock(&indirect_mutex);
+    int block = block_of(node, link);
+    pthread_mutex_unlock(&indirect_mutex);
+
+    return block;
+}
+
+bool indirect_unwritten(INode *node, int link) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    IndirectSlot *slot;
+    __uint32_t *pointer = find_pointer(node, link, false, -1, &slot);
+    bool unwritten = pointer && (*pointer & POINTER_UNWRITTEN);
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return unwritten;
+}
+
+int indirect_set_unwritten(INode *node, int link, bool unwritten) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    IndirectSlot *slot;
+    __uint32_t *pointer = find_pointer(node, link, false, -1, &slot);
+    if (!pointer || *pointer == 0) {
+        pthread_mutex_unlock(&indirect_mutex);
+        return -1;
+    }
+
+    __uint32_t updated = unwritten ? *pointer | POINTER_UNWRITTEN : *pointer & ~POINTER_UNWRITTEN;
+    if (updated != *pointer) {
+        *pointer = updated;
+        if (slot) {
+            slot->dirty = true;
+        }
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return 0;
+}
+
+int indirect_map(INode *node, int link, int block, int length, bool unwritten) {
+    if (link < 0 || length <= 0 || length > indirect_max_links() - link) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&indirect_mutex);
+
+    // Check the whole range first, so a link that's already mapped leaves the map as it was.
+    int index = 0;
+    for (; index < length; index++) {
+        if (block_of(node, link + index) != -1) {
+            pthread_mutex_unlock(&indirect_mutex);
+            return -1;
+        }
+    }
+
+    for (index = 0; index < length; index++) {
+        IndirectSlot *slot;
+        __uint32_t *pointer = find_pointer(node, link + index, true, block + index, &slot);
+        if (!pointer) {
+            break;
+        }
+
+        *pointer = (__uint32_t) (block + index) | (unwritten ? POINTER_UNWRITTEN : 0);
+        if (slot) {
+            slot->dirty = true;
+        }
+    }
+
+    if (index == length) {
+        pthread_mutex_unlock(&indirect_mutex);
+        return 0;
+    }
+
+    // Unpoint what was mapped so far, the indirect blocks reserved on the way stay with the i-node.
+    while (index-- > 0) {
+        IndirectSlot *slot;
+        __uint32_t *pointer = find_pointer(node, link + index, false, -1, &slot);
+        if (pointer) {
+            *pointer = 0;
+            if (slot) {
+                slot->dirty = true;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return -1;
+}
+
+int indirect_metadata_needed(INode *node, int link, int countPending(int first, int last, void *extra), void *extra) {
+    int offsets[4];
+    int depth = path_of(link, offsets);
+    if (depth <= 0) {
+        return 0;
+    }
+
+    // The links under the top indirect block, and the first of them.
+    long long first = INODE_DIRECT_LINKS;
+    long long span = POINTERS_PER_BLOCK;
+
+    int level = 1;
+    for (; level < depth; level++) {
+        first += span;
+        span *= POINTERS_PER_BLOCK;
+    }
+
+    pthread_mutex_lock(&indirect_mutex);
+
+    __uint32_t pointer = node->pointers[offsets[0]];
+    int needed = 0;
+
+    // Once the way down hits a hole every block below it is missing too. A missing block is only counted once, by
+    // the first pending link under it.
+    for (level = 1; level <= depth; level++) {
+        if (pointer == 0) {
+            long long last = first + span - 1;
+            needed += countPending((int) first, last < INT_MAX ? (int) last : INT_MAX, extra) == 0;
+        } else {
+            IndirectSlot *slot = get_slot(node, (int) (pointer & ~POINTER_UNWRITTEN), false);
+            if (!slot) {
+                pthread_mutex_unlock(&indirect_mutex);
+                return -1;
+            }
+
+            pointer = slot->pointers[offsets[level]];
+        }
+
+        span /= POINTERS_PER_BLOCK;
+        first += offsets[level] * span;
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return needed;
+}
+
+int indirect_goal(INode *node, int link) {
+    if (link - 1 < FIRST_DATA_LINK) {
+        return -1;
+    }
+
+    int block = indirect_block(node, link - 1);
+    return block == -1 ? -1 : block + 1;
+}
+
+void indirect_serialize(INode *node, ByteBuffer *byteBuffer) {
+    int index = 0;
+    for (; index < INODE_POINTERS; index++) {
+        writeInt(byteBuffer, node->pointers[index]);
+    }
+}
+
+void indirect_load(INode *node, ByteBuffer *byteBuffer) {
+    int index = 0;
+    for (; index < INODE_POINTERS; index++) {
+        node->pointers[index] = readInt(byteBuffer);
+    }
+}
+
+int indirect_dirty_blocks(INode *node) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    int count = 0;
+
+    int index = 0;
+    for (; index < INDIRECT_CACHE_SLOTS; index++) {
+        count += slots[index].block != 0 && slots[index].node == node && slots[index].dirty;
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return count;
+}
+
+int indirect_serialize_dirty(INode *node, int *blocks, Byte *buffer) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    int count = 0;
+
+    int index = 0;
+    for (; index < INDIRECT_CACHE_SLOTS; index++) {
+        IndirectSlot *slot = slots + index;
+        if (slot->block == 0 || slot->node != node || !slot->dirty) {
+            continue;
+        }
+
+        encode(slot, buffer + (size_t) count * BLOCK_SIZE);
+        slot->dirty = false;
+        blocks[count++] = slot->block;
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return count;
+}
+
+/**
+ * Lists the block behind @pointer, and when it's an indirect block with @depth levels below it, every block under it.
+ * Must be called with the indirect mutex held.
+ * @return The number of blocks, -1 if an indirect block couldn't be read.
+ */
+static int collect(INode *node, __uint32_t pointer, int depth, int *blocks) {
+    if (pointer == 0) {
+        return 0;
+    }
+
+    int block = (int) (pointer & ~POINTER_UNWRITTEN);
+    if (blocks) {
+        blocks[0] = block;
+    }
+
+    if (depth == 0) {
+        return 1;
+    }
+
+    // Copied out, the slot may be reused while the blocks below it are read.
+    IndirectSlot *slot = get_slot(node, block, false);
+    if (!slot) {
+        return -1;
+    }
+
+    __uint32_t children[POINTERS_PER_BLOCK];
+    memcpy(children, slot->pointers, sizeof(children));
+
+    int count = 1;
+
+    int index = 0;
+    for (; index < POINTERS_PER_BLOCK; index++) {
+        int found = collect(node, children[index], depth - 1, blocks ? blocks + count : NULL);
+        if (found < 0) {
+            return -1;
+        }
+
+        count += found;
+    }
+
+    return count;
+}
+
+int indirect_blocks(INode *node, int *blocks) {
+    pthread_mutex_lock(&indirect_mutex);
+
+    int count = 0;
+
+    int index = 0;
+    for (; index < INODE_POINTERS; index++) {
+        int depth = index < INODE_DIRECT_LINKS ? 0 : index - INODE_DIRECT_LINKS + 1;
+
+        int found = collect(node, node->pointers[index], depth, blocks ? blocks + count : NULL);
+        if (found < 0) {
+            count = -1;
+            break;
+        }
+
+        count += found;
+    }
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return count;
+}
+
+int indirect_cache_reset() {
+    int retstat = 0;
+
+    pthread_mutex_lock(&indirect_mutex);
+
+    int index = 0;
+    for (; index < INDIRECT_CACHE_SLOTS; index++) {
+        IndirectSlot *slot = slots + index;
+        if (slot->block != 0 && write_back(slot) < 0) {
+            retstat = -1;
+        }
+
+        free(slot->pointers);
+        memset(slot, 0, sizeof(IndirectSlot));
+    }
+
+    clockHand = 0;
+
+    pthread_mutex_unlock(&indirect_mutex);
+    return retstat;
+}
@@ -0,0 +1,92 @@
+#ifndef ASSIGNMENT3_INDIRECT_H
+#define ASSIGNMENT3_INDIRECT_H
+
+#include "helper.h"
+
+/**
+ * Empties an indirectly mapped i-node's pointers, without releasing anything they pointed at.
+ */
+void indirect_init(INode *);
+
+/**
+ * Drops the i-node's indirect blocks from the cache without writing them back, once their blocks are released.
+ */
+void indirect_release(INode *);
+
+/**
+ * Returns how many links the direct pointers and the triple indirect block can reach, bounded by MAX_FILE_LINKS.
+ */
+int indirect_max_links();
+
+/**
+ * Finds the data block a link points at, following the cached indirect blocks down.
+ * @return The block, -1 if the link is a hole.
+ */
+int indirect_block(INode *, int link);
+
+/**
+ * Returns whether the block behind a link was preallocated and never written.
+ */
+_Bool indirect_unwritten(INode *, int link);
+
+/**
+ * Marks the block behind a mapped link as preallocated but unwritten, or as holding data.
+ * @return 0 on success, -1 if the link isn't mapped.
+ */
+int indirect_set_unwritten(INode *, int link, _Bool unwritten);
+
+/**
+ * Points @length unmapped links from @link on at the consecutive blocks from @block on, reserving the indirect blocks
+ * on the way down as they're needed.
+ * @return 0 on success, -1 if a link was already mapped, is out of reach or an indirect block couldn't be had.
+ */
+int indirect_map(INode *, int link, int block, int length, _Bool unwritten);
+
+/**
+ * Returns how many indirect blocks mapping the unmapped @link could add, leaving out the ones a link counted by
+ * @countPending already needs.
+ * @return The number of blocks, -1 if an indirect block couldn't be read.
+ */
+int indirect_metadata_needed(INode *, int link, int countPending(int first, int last, void *extra), void *extra);
+
+/**
+ * Returns where a block for @link would best go, right behind the block of the link before it.
+ * @return The block, -1 if the link before it isn't mapped.
+ */
+int indirect_goal(INode *, int link);
+
+/**
+ * Writes the i-node's block pointers.
+ */
+void indirect_serialize(INode *, ByteBuffer *);
+
+/**
+ * Reads the i-node's block pointers back, the indirect blocks are only read once a link under them is looked up.
+ */
+void indirect_load(INode *, ByteBuffer *);
+
+/**
+ * Returns how many of the i-node's cached indirect blocks changed since they were last written.
+ */
+int indirect_dirty_blocks(INode *);
+
+/**
+ * Fills @buffer with every cached indirect block of the i-node that changed since it was last written, and @blocks
+ * with where each one goes.
+ * @return The number of blocks filled in.
+ */
+int indirect_serialize_dirty(INode *, int *blocks, Byte *buffer);
+
+/**
+ * Lists every data block and indirect block the i-node points at into @blocks, if it isn't NULL.
+ * @return The number of them, -1 if an indirect block couldn't be read.
+ */
+int indirect_blocks(INode *, int *blocks);
+
+/**
+ * Writes back every changed indirect block and empties the cache, before the disk is closed.
+ * @return 0 on success, -1 if a block couldn't be written.
+ */
+int indirect_cache_reset();
+
+#endif //ASSIGNMENT3_INDIRECT_H
@@ -0,0 +1,500 @@
+#include <time.h>
+
+#include "itable.h"
+#include "blockmap.h"
+
+/**
+ * Where each chunk of the table starts on the disk.
+ */
+static int *chunkStarts = NULL;
+
+static int numChunks = 0;
+
+/**
+ * An i-node faulted in from the table. The i-node comes first so a pointer to it is a pointer to it's entry.
+ */
+typedef struct CachedNode {
+    INode node;
+
+    /**
+     * Taken by whoever changes or serializes the i-node, and it's extent map with it.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * How many callers are holding the i-node, it can't be evicted until they've all put it back.
+     */
+    int refs;
+
+    /**
+     * Whether it changed since it was last written, it's on the dirty list until the next write back.
+     */
+    bool dirty;
+
+    /**
+     * Whether it's on the clean list, unheld and waiting to be evicted.
+     */
+    bool idle;
+
+    struct CachedNode *next;
+    struct CachedNode *newer, *older;
+    struct CachedNode *nextDirty;
+} CachedNode;
+
+/**
+ * The number of hash chains in the i-node cache.
+ */
+#define NODE_CACHE_BUCKETS 1024
+
+/**
+ * The i-nodes faulted in so far, chained by their number.
+ */
+static CachedNode *nodeCache[NODE_CACHE_BUCKETS];
+static int numCached = 0;
+
+/**
+ * The unheld clean i-nodes, least recently put back at the oldest end.
+ */
+static CachedNode *newestIdle = NULL;
+static CachedNode *oldestIdle = NULL;
+
+static CachedNode *dirtyList = NULL;
+static int numDirty = 0;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool writebackRunning = false;
+static int writebackInterval = 0;
+static pthread_t writebackWorker;
+
+static pthread_mutex_t writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Drops every cached i-node, from a previous mount.
+ */
+static void cache_clear() {
+    int bucket = 0;
+    for (; bucket < NODE_CACHE_BUCKETS; bucket++) {
+        while (nodeCache[bucket]) {
+            CachedNode *cached = nodeCache[bucket];
+            nodeCache[bucket] = cached->next;
+
+            links_release(&cached->node);
+            free(cached->node.inlineData);
+            pthread_mutex_destroy(&cached->lock);
+            free(cached);
+        }
+    }
+
+    numCached = 0;
+    newestIdle = oldestIdle = NULL;
+    dirtyList = NULL;
+    numDirty = 0;
+}
+
+/**
+ * Finds a cached i-node, must be called with the cache mutex held.
+ */
+static CachedNode *cache_find(ino_t id) {
+    CachedNode *cached = nodeCache[id % NODE_CACHE_BUCKETS];
+    for (; cached && cached->node.id != id; cached = cached->next);
+
+    return cached;
+}
+
+static void idle_remove(CachedNode *cached) {
+    if (!cached->idle) {
+        return;
+    }
+
+    if (cached->newer) {
+        cached->newer->older = cached->older;
+    } else {
+        newestIdle = cached->older;
+    }
+
+    if (cached->older) {
+        cached->older->newer = cached->newer;
+    } else {
+        oldestIdle = cached->newer;
+    }
+
+    cached->newer = cached->older = NULL;
+    cached->idle = false;
+}
+
+static void idle_push(CachedNode *cached) {
+    cached->older = newestIdle;
+    cached->newer = NULL;
+
+    if (newestIdle) {
+        newestIdle->newer = cached;
+    } else {
+        oldestIdle = cached;
+    }
+
+    newestIdle = cached;
+    cached->idle = true;
+}
+
+/**
+ * Evicts unheld clean i-nodes from the oldest end until the cache is back under NODE_CACHE_MAX. Must be called with
+ * the cache mutex held.
+ */
+static void cache_trim() {
+    CachedNode *cached = oldestIdle;
+    while (cached && numCached > NODE_CACHE_MAX) {
+        CachedNode *newer = cached->newer;
+
+        // Leaf or indirect blocks that never made it to the disk keep their i-node around.
+        if (links_dirty_blocks(&cached->node) > 0) {
+            cached = newer;
+            continue;
+        }
+
+        idle_remove(cached);
+
+        CachedNode **link = &nodeCache[cached->node.id % NODE_CACHE_BUCKETS];
+        for (; *link != cached; link = &(*link)->next);
+        *link = cached->next;
+
+        links_release(&cached->node);
+        free(cached->node.inlineData);
+        pthread_mutex_destroy(&cached->lock);
+        free(cached);
+        numCached--;
+
+        cached = newer;
+    }
+}
+
+int itable_init() {
+    free(chunkStarts);
+
+    pthread_mutex_lock(&cache_mutex);
+    cache_clear();
+    pthread_mutex_unlock(&cache_mutex);
+
+    chunkStarts = (int *) calloc((size_t) MAX_INODE_CHUNKS, sizeof(int));
+    numChunks = 0;
+
+    return chunkStarts ? 0 : -1;
+}
+
+int itable_count() {
+    return __atomic_load_n(&numChunks, __ATOMIC_ACQUIRE) * INODES_PER_CHUNK;
+}
+
+int itable_chunks() {
+    return __atomic_load_n(&numChunks, __ATOMIC_ACQUIRE);
+}
+
+INode *node_get(ino_t id) {
+    if (id >= (ino_t) itable_count()) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    CachedNode *cached = cache_find(id);
+    if (cached) {
+        idle_remove(cached);
+        cached->refs++;
+
+        pthread_mutex_unlock(&cache_mutex);
+        return &cached->node;
+    }
+
+    cached = (CachedNode *) calloc(1, sizeof(CachedNode));
+    if (!cached) {
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+
+    // Faulted in under the mutex, so two lookups of the same i-node never load it twice.
+    Byte buffer[BLOCK_SIZE];
+    if (block_read(itable_block_of(id), buffer) <= 0) {
+        fprintf(stderr, "Could not read i-node %lu, it's left unused.\n", (unsigned long) id);
+        node_stat(&cached->node, id, S_IFREG | S_IRWXU, DEFAULT_NUM_DIRECTORIES);
+    } else {
+        load_iNode(&cached->node, buffer + (size_t) (id % INODES_PER_BLOCK) * INODE_RECORD_BYTES);
+        cached->node.id = id;
+    }
+
+    pthread_mutex_init(&cached->lock, NULL);
+    cached->refs = 1;
+    cached->next = nodeCache[id % NODE_CACHE_BUCKETS];
+    nodeCache[id % NODE_CACHE_BUCKETS] = cached;
+    numCached++;
+
+    cache_trim();
+
+    pthread_mutex_unlock(&cache_mutex);
+    return &cached->node;
+}
+
+void node_hold(INode *node) {
+    pthread_mutex_lock(&cache_mutex);
+
+    CachedNode *cached = (CachedNode *) node;
+    idle_remove(cached);
+    cached->refs++;
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void node_lock(INode *node) {
+    pthread_mutex_lock(&((CachedNode *) node)->lock);
+}
+
+void node_unlock(INode *node) {
+    pthread_mutex_unlock(&((CachedNode *) node)->lock);
+}
+
+void node_put(INode *node) {
+    if (!node) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    CachedNode *cached = (CachedNode *) node;
+    if (cached->refs <= 0) {
+        fprintf(stderr, "I-node %lu was put back more often than it was held.\n", (unsigned long) node->id);
+    } else if (--cached->refs == 0 && !cached->dirty) {
+        idle_push(cached);
+        cache_trim();
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Puts an i-node on the dirty list, must be called with the cache mutex held.
+ */
+static void mark_dirty(CachedNode *cached) {
+    if (cached->dirty) {
+        return;
+    }
+
+    idle_remove(cached);
+
+    cached->dirty = true;
+    cached->nextDirty = dirtyList;
+    dirtyList = cached;
+    numDirty++;
+}
+
+void node_dirty(INode *node) {
+    pthread_mutex_lock(&cache_mutex);
+    mark_dirty((CachedNode *) node);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int itable_balance_dirty() {
+    pthread_mutex_lock(&cache_mutex);
+    bool full = numDirty > NODE_DIRTY_MAX;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return full ? itable_writeback() : 0;
+}
+
+static int compare_nodes(const void *first, const void *second) {
+    ino_t a = (*(INode **) first)->id;
+    ino_t b = (*(INode **) second)->id;
+
+    return a < b ? -1 : a > b;
+}
+
+int itable_writeback() {
+    pthread_mutex_lock(&cache_mutex);
+
+    int count = numDirty;
+    INode **nodes = count > 0 ? (INode **) malloc(sizeof(INode *) * count) : NULL;
+    if (!nodes) {
+        pthread_mutex_unlock(&cache_mutex);
+        return count > 0 ? -1 : 0;
+    }
+
+    // Held while they're written, and clean from here on so a change made meanwhile dirties them again.
+    int index = 0;
+    CachedNode *cached = dirtyList;
+    for (; cached; cached = cached->nextDirty) {
+        cached->dirty = false;
+        cached->refs++;
+        nodes[index++] = &cached->node;
+    }
+
+    dirtyList = NULL;
+    numDirty = 0;
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    // In i-node order neighbours in a table block sit next to each other, and each block goes out once. Their locks
+    // are taken in that order too, so two write backs never wait on each other.
+    qsort(nodes, (size_t) count, sizeof(INode *), compare_nodes);
+
+    for (index = 0; index < count; index++) {
+        node_lock(nodes[index]);
+    }
+
+    int retstat = flush_iNodes(nodes, count);
+
+    for (index = 0; index < count; index++) {
+        node_unlock(nodes[index]);
+    }
+
+    if (retstat < 0) {
+        pthread_mutex_lock(&cache_mutex);
+        for (index = 0; index < count; index++) {
+            mark_dirty((CachedNode *) nodes[index]); // Tried again on the next pass.
+        }
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    for (index = 0; index < count; index++) {
+        node_put(nodes[index]);
+    }
+
+    free(nodes);
+
+    log_msg("\nwriteback: i-nodes=%d status=%d\n", count, retstat);
+    return retstat;
+}
+
+static void *writeback_worker(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&writeback_mutex);
+    while (writebackRunning) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += writebackInterval;
+
+        // Sleep out the interval, unless itable_writeback_stop wakes us first.
+        if (pthread_cond_timedwait(&writeback_cond, &writeback_mutex, &wake) != ETIMEDOUT || !writebackRunning) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&writeback_mutex);
+        itable_writeback();
+        pthread_mutex_lock(&writeback_mutex);
+    }
+    pthread_mutex_unlock(&writeback_mutex);
+
+    return NULL;
+}
+
+int itable_writeback_start(int interval) {
+    if (interval <= 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&writeback_mutex);
+    writebackInterval = interval;
+    writebackRunning = true;
+    pthread_mutex_unlock(&writeback_mutex);
+
+    if (pthread_create(&writebackWorker, NULL, writeback_worker, NULL) != 0) {
+        writebackRunning = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void itable_writeback_stop() {
+    pthread_mutex_lock(&writeback_mutex);
+    if (!writebackRunning) {
+        pthread_mutex_unlock(&writeback_mutex);
+        return;
+    }
+
+    writebackRunning = false;
+    pthread_cond_signal(&writeback_cond);
+    pthread_mutex_unlock(&writeback_mutex);
+
+    pthread_join(writebackWorker, NULL);
+}
+
+int itable_block_of(ino_t id) {
+    return chunkStarts[id / INODES_PER_CHUNK] + (int) (id % INODES_PER_CHUNK) / INODES_PER_BLOCK;
+}
+
+int itable_grow() {
+    if (numChunks >= MAX_INODE_CHUNKS) {
+        fprintf(stderr, "The i-node table can't grow past %d chunks.\n", MAX_INODE_CHUNKS);
+        return -1;
+    }
+
+    int *blocks = (int *) malloc(sizeof(int) * INODE_CHUNK_BLOCKS);
+    Byte *buffer = (Byte *) calloc((size_t) INODE_CHUNK_BLOCKS, BLOCK_SIZE);
+    if (!blocks || !buffer) {
+        free(blocks);
+        free(buffer);
+        return -1;
+    }
+
+    // Lookups find an i-node at an offset from it's chunk's start, so the chunk has to be one run.
+    int length = 0;
+    int start = block_reserve_run(-1, INODE_CHUNK_BLOCKS, &length);
+    if (start == -1 || length < INODE_CHUNK_BLOCKS) {
+        for (; start != -1 && length > 0; length--) {
+            block_unreserve(start + length - 1);
+        }
+
+        fprintf(stderr, "No run of %d free blocks left for another i-node chunk.\n", INODE_CHUNK_BLOCKS);
+        free(blocks);
+        free(buffer);
+        return -1;
+    }
+
+    int index = 0;
+    for (; index < INODE_CHUNK_BLOCKS; index++) {
+        blocks[index] = start + index;
+    }
+
+    // The new records are written straight out, they're only faulted in once they're handed out.
+    format_iNodes((ino_t) numChunks * INODES_PER_CHUNK, INODES_PER_CHUNK, buffer);
+    int retstat = block_writev(blocks, INODE_CHUNK_BLOCKS, buffer, NULL);
+
+    free(blocks);
+    free(buffer);
+
+    if (retstat < 0) {
+        for (index = 0; index < INODE_CHUNK_BLOCKS; index++) {
+            block_unreserve(start + index);
+        }
+
+        return -1;
+    }
+
+    chunkStarts[numChunks] = start;
+    __atomic_store_n(&numChunks, numChunks + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void itable_serialize(ByteBuffer *byteBuffer) {
+    writeInt(byteBuffer, (__uint32_t) numChunks);
+
+    int chunk = 0;
+    for (; chunk < numChunks; chunk++) {
+        writeInt(byteBuffer, (__uint32_t) chunkStarts[chunk]);
+    }
+}
+
+int itable_load(ByteBuffer *byteBuffer) {
+    int count = (int) readInt(byteBuffer);
+    if (count < 0 || count > MAX_INODE_CHUNKS) {
+        return -1;
+    }
+
+    int chunk = 0;
+    for (; chunk < count; chunk++) {
+        chunkStarts[chunk] = (int) readInt(byteBuffer);
+    }
+
+    __atomic_store_n(&numChunks, count, __ATOMIC_RELEASE);
+    return 0;
+}
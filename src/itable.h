@@ -0,0 +1,120 @@
+#ifndef ASSIGNMENT3_ITABLE_H
+#define ASSIGNMENT3_ITABLE_H
+
+#include "helper.h"
+
+/**
+ * How many i-nodes the cache holds before unheld clean ones start being evicted.
+ */
+#define NODE_CACHE_MAX 4096
+
+/**
+ * How many dirty i-nodes the cache holds before the one dirtying another writes them all back itself, through
+ * itable_balance_dirty.
+ */
+#define NODE_DIRTY_MAX 256
+
+/**
+ * Seconds between write backs of the dirty i-nodes, unless the writeback_interval mount option says otherwise.
+ */
+#define DEFAULT_WRITEBACK_INTERVAL 5
+
+/**
+ * Sets up an empty chunk index with room for MAX_INODE_CHUNKS chunks, so it never moves while the table grows, and
+ * drops the i-nodes cached by a previous mount.
+ * @return 0 on success, -1 if it couldn't be allocated.
+ */
+int itable_init();
+
+/**
+ * Returns the number of i-nodes the table's chunks hold.
+ */
+int itable_count();
+
+/**
+ * Returns the number of chunks the table has.
+ */
+int itable_chunks();
+
+/**
+ * Finds an i-node by it's number in the i-node cache, reading it's record from the table the first time it's asked
+ * for, and holds it. It stays put in memory until it's put back with node_put.
+ * @return The i-node, NULL if the table doesn't reach that far or it couldn't be cached.
+ */
+INode *node_get(ino_t id);
+
+/**
+ * Holds an i-node that is already held, for keeping it past the caller's own node_put.
+ */
+void node_hold(INode *);
+
+/**
+ * Locks a held i-node, for changing it or reading more than one of it's fields. Locks are taken in this order:
+ * i-nodes, lowest number first if more than one, then delayed writes, then the table, then the rest. So no i-node is
+ * locked by someone who holds the delayed write lock, and one already holding an i-node's lock takes no other.
+ */
+void node_lock(INode *);
+
+void node_unlock(INode *);
+
+/**
+ * Puts back an i-node from node_get or node_hold. Once nobody holds it and it's clean it can be evicted,
+ * least recently used first.
+ */
+void node_put(INode *);
+
+/**
+ * Marks a held i-node as changed, it's written by the next write back instead of right away. The caller follows up
+ * with itable_balance_dirty once it's let go of the i-node's lock.
+ */
+void node_dirty(INode *);
+
+/**
+ * Writes back every dirty i-node if there are more than NODE_DIRTY_MAX of them. Must be called without any i-node's
+ * lock held.
+ * @return 0 on success, -1 if the write back failed.
+ */
+int itable_balance_dirty();
+
+/**
+ * Writes every dirty i-node back in one batch, sorted by number so each table block goes out once. Must be called
+ * without any i-node's lock held, it takes them all.
+ * @return 0 on success, -1 if the batch couldn't be written, the i-nodes stay dirty then.
+ */
+int itable_writeback();
+
+/**
+ * Starts a worker that calls itable_writeback every @interval seconds.
+ * @return 0 on success, -1 if the worker couldn't be started.
+ */
+int itable_writeback_start(int interval);
+
+/**
+ * Stops the worker, waiting for a write back that is running to finish.
+ */
+void itable_writeback_stop();
+
+/**
+ * Returns the table block holding an i-node's record.
+ */
+int itable_block_of(ino_t id);
+
+/**
+ * Adds a chunk to the table: INODE_CHUNK_BLOCKS consecutive data blocks, formatted with unused i-nodes and written
+ * out. The i-node bit map and free count are left to the caller.
+ * @return 0 on success, -1 if the index is full, no run of free blocks is long enough or the chunk couldn't be written.
+ */
+int itable_grow();
+
+/**
+ * Writes the number of chunks and where each one starts, behind the super block's fields.
+ */
+void itable_serialize(ByteBuffer *);
+
+/**
+ * Reads the chunk index back, the i-nodes themselves are only read as they're looked up.
+ * @return 0 on success, -1 if the index doesn't make sense.
+ */
+int itable_load(ByteBuffer *);
+
+#endif //ASSIGNMENT3_ITABLE_H
@@ -26,6 +26,14 @@
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    size_t cachesize;
+    int backend;
+    int odirect;
+    int blocksize;
+    int freetree;
+    int checkinterval;
+    int writebackinterval;
+    int indirect;
 };
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
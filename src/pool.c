@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct BufferPool {
+    size_t size, alignment;
+
+    char *slab;
+    int count;
+
+    /**
+     * Stack of the buffers that are free to hand out.
+     */
+    void **free;
+    int numFree;
+
+    pthread_mutex_t mutex;
+};
+
+BufferPool *pool_allocate(int count, size_t size, size_t alignment) {
+    BufferPool *pool = (BufferPool *) malloc(sizeof(BufferPool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->size = size;
+    pool->alignment = alignment;
+    pool->count = count;
+    pool->free = (void **) malloc(sizeof(void *) * count);
+    if (!pool->free || posix_memalign((void **) &pool->slab, alignment, size * count) != 0) {
+        free(pool->free);
+        free(pool);
+        return NULL;
+    }
+
+    int index = 0;
+    for (; index < count; index++) {
+        pool->free[index] = pool->slab + size * index;
+    }
+    pool->numFree = count;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void pool_deallocate(BufferPool *pool) {
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->slab);
+    free(pool->free);
+    free(pool);
+}
+
+void *pool_get(BufferPool *pool) {
+    void *buffer = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->numFree > 0) {
+        buffer = pool->free[--pool->numFree];
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!buffer && posix_memalign(&buffer, pool->alignment, pool->size) != 0) {
+        return NULL;
+    }
+
+    return buffer;
+}
+
+void pool_put(BufferPool *pool, void *buffer) {
+    char *position = (char *) buffer;
+    if (position < pool->slab || position >= pool->slab + pool->size * pool->count) {
+        free(buffer); // A spare from when the pool ran dry.
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->free[pool->numFree++] = buffer;
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,30 @@
+#ifndef ASSIGNMENT3_POOL_H
+#define ASSIGNMENT3_POOL_H
+
+#include <stddef.h>
+
+/**
+ * A fixed set of equally sized, aligned buffers handed out and returned by many threads.
+ */
+typedef struct BufferPool BufferPool;
+
+/**
+ * Allocates @count buffers of @size bytes, each starting on an @alignment boundary.
+ * @return The pool, or NULL if it couldn't be allocated.
+ */
+BufferPool *pool_allocate(int count, size_t size, size_t alignment);
+
+void pool_deallocate(BufferPool *);
+
+/**
+ * Takes a buffer from the pool, a spare one is allocated when the pool runs dry.
+ * @return The buffer, or NULL if no buffer could be allocated.
+ */
+void *pool_get(BufferPool *);
+
+/**
+ * Gives a buffer from pool_get back.
+ */
+void pool_put(BufferPool *, void *);
+
+#endif //ASSIGNMENT3_POOL_H
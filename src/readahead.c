@@ -0,0 +1,154 @@
+#include "readahead.h"
+#include "blockmap.h"
+
+typedef struct {
+    int blocks[READAHEAD_MAX_BLOCKS];
+    int count;
+} Prefetch;
+
+static Prefetch queue[READAHEAD_QUEUE_DEPTH];
+static int queueHead = 0, queueLength = 0;
+
+static bool running = false;
+static pthread_t worker;
+
+static pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+
+static void *readahead_worker(void *unused) {
+    (void) unused;
+    Prefetch prefetch;
+
+    pthread_mutex_lock(&readahead_mutex);
+    while (running) {
+        if (queueLength == 0) {
+            pthread_cond_wait(&readahead_cond, &readahead_mutex);
+            continue;
+        }
+
+        prefetch = queue[queueHead];
+        queueHead = (queueHead + 1) % READAHEAD_QUEUE_DEPTH;
+        queueLength--;
+
+        pthread_mutex_unlock(&readahead_mutex);
+        block_prefetch(prefetch.blocks, prefetch.count);
+        pthread_mutex_lock(&readahead_mutex);
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+
+    return NULL;
+}
+
+int readahead_start() {
+    pthread_mutex_lock(&readahead_mutex);
+    queueHead = 0;
+    queueLength = 0;
+    running = true;
+    pthread_mutex_unlock(&readahead_mutex);
+
+    if (pthread_create(&worker, NULL, readahead_worker, NULL) != 0) {
+        running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void readahead_stop() {
+    pthread_mutex_lock(&readahead_mutex);
+    if (!running) {
+        pthread_mutex_unlock(&readahead_mutex);
+        return;
+    }
+
+    running = false;
+    pthread_cond_signal(&readahead_cond);
+    pthread_mutex_unlock(&readahead_mutex);
+
+    pthread_join(worker, NULL);
+}
+
+ReadAhead *readahead_allocate() {
+    ReadAhead *readAhead = (ReadAhead *) malloc(sizeof(ReadAhead));
+    if (!readAhead) {
+        return NULL;
+    }
+
+    readAhead->nextLink = FIRST_DATA_LINK; // Reading from the start counts as sequential.
+    readAhead->window = 0;
+    readAhead->aheadLink = FIRST_DATA_LINK;
+    return readAhead;
+}
+
+/**
+ * Hands a run of blocks to the worker, dropping it if the worker is too far behind.
+ */
+static void enqueue(const int *blocks, int count) {
+    pthread_mutex_lock(&readahead_mutex);
+    if (running && queueLength < READAHEAD_QUEUE_DEPTH) {
+        Prefetch *prefetch = queue + (queueHead + queueLength) % READAHEAD_QUEUE_DEPTH;
+        memcpy(prefetch->blocks, blocks, sizeof(int) * count);
+        prefetch->count = count;
+
+        queueLength++;
+        pthread_cond_signal(&readahead_cond);
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+}
+
+void readahead_update(ReadAhead *readAhead, INode *node, int firstLink, int lastLink) {
+    if (!readAhead) {
+        return;
+    }
+
+    // A read that picks up in the block the last one ended in is still sequential.
+    bool sequential = firstLink == readAhead->nextLink || firstLink == readAhead->nextLink - 1;
+    readAhead->nextLink = lastLink + 1;
+
+    if (!sequential) {
+        readAhead->window /= 2;
+        if (readAhead->window < READAHEAD_MIN_BLOCKS) {
+            readAhead->window = 0;
+        }
+        readAhead->aheadLink = lastLink + 1;
+        return;
+    }
+
+    readAhead->window = readAhead->window ? readAhead->window * 2 : READAHEAD_MIN_BLOCKS;
+    if (readAhead->window > READAHEAD_MAX_BLOCKS) {
+        readAhead->window = READAHEAD_MAX_BLOCKS;
+    }
+
+    if (readAhead->aheadLink < lastLink + 1) {
+        readAhead->aheadLink = lastLink + 1;
+    }
+
+    // Only top up once the reader has eaten into half of what's already prefetched.
+    if (readAhead->aheadLink - (lastLink + 1) > readAhead->window / 2) {
+        return;
+    }
+
+    int endLink = (int) (FIRST_DATA_LINK + (node->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (endLink > lastLink + 1 + readAhead->window) {
+        endLink = lastLink + 1 + readAhead->window;
+    }
+
+    int blocks[READAHEAD_MAX_BLOCKS];
+    int count = 0;
+
+    int link = readAhead->aheadLink;
+    for (; link < endLink && count < READAHEAD_MAX_BLOCKS; link++) {
+        int block = link_block(node, link);
+        if (block != -1 && !link_unwritten(node, link)) {
+            blocks[count++] = block;
+        }
+    }
+
+    if (link > readAhead->aheadLink) {
+        readAhead->aheadLink = link;
+    }
+
+    if (count > 0) {
+        enqueue(blocks, count);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef ASSIGNMENT3_READAHEAD_H
+#define ASSIGNMENT3_READAHEAD_H
+
+#include "helper.h"
+
+/**
+ * The window a stream of sequential reads starts with, and the most it can grow to, in blocks.
+ */
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+
+/**
+ * How many prefetches can wait for the worker before new ones are dropped.
+ */
+#define READAHEAD_QUEUE_DEPTH 32
+
+/**
+ * Read-ahead state of one open file, kept in the file handle.
+ */
+typedef struct {
+    /**
+     * The link a sequential reader would read next.
+     */
+    int nextLink;
+
+    /**
+     * Blocks to keep prefetched ahead of the reader, 0 while the reads look random.
+     */
+    int window;
+
+    /**
+     * The first link that hasn't been prefetched yet.
+     */
+    int aheadLink;
+} ReadAhead;
+
+/**
+ * Starts the worker thread that runs the prefetches.
+ * @return 0 on success, -1 on failure.
+ */
+int readahead_start();
+
+/**
+ * Stops the worker, any prefetch still queued is dropped.
+ */
+void readahead_stop();
+
+/**
+ * Creates the read-ahead state for a newly opened file.
+ * @return The state, NULL if it couldn't be allocated.
+ */
+ReadAhead *readahead_allocate();
+
+/**
+ * Feeds a read of links @firstLink to @lastLink of the i-node to the detector. Sequential reads grow the window and
+ * queue the next run of the file's written blocks for the worker, random reads shrink it.
+ */
+void readahead_update(ReadAhead *, INode *, int firstLink, int lastLink);
+
+#endif //ASSIGNMENT3_READAHEAD_H
@@ -10,7 +10,19 @@
 #include "sfs.h"
 #include "helper.h"
 #include "bitmap.h"
+#include "blockmap.h"
 #include "bytebuffer.h"
+#include "cache.h"
+#include "check.h"
+#include "delalloc.h"
+#include "group.h"
+#include "indirect.h"
+#include "itable.h"
+#include "readahead.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
 
 ///////////////////////////////////////////////////////////
 //
@@ -39,7 +51,7 @@ void *sfs_init(struct fuse_conn_info *conn) {
 
     // Initailize all the blocks here.
 
-    disk_open(SFS_DATA->diskfile);
+    disk_open(SFS_DATA->diskfile, SFS_DATA->backend, SFS_DATA->odirect);
 
     if (pthread_mutex_init(&init_mutex, NULL) < 0) {
         return NULL;
@@ -47,6 +59,37 @@ void *sfs_init(struct fuse_conn_info *conn) {
 
     pthread_mutex_lock(&init_mutex);
 
+    // The block size follows the magic at the front of the super block, so read that before anything else.
+    char header[MIN_BLOCK_SIZE];
+    disk_set_block_size(MIN_BLOCK_SIZE);
+
+    int blockSize = SFS_DATA->blocksize;
+    _Bool formatted = disk_read(SUPER_BLOCK_INDEX, header) > 0;
+    if (formatted) {
+        ByteBuffer byteBuffer = {0, MIN_BLOCK_SIZE, header};
+        if (readInt(&byteBuffer) != SFS_MAGIC) {
+            fprintf(stderr, "%s is not an sfs disk.\n", SFS_DATA->diskfile);
+            return NULL;
+        }
+
+        blockSize = (int) readInt(&byteBuffer);
+    }
+
+    if (disk_set_block_size(blockSize) < 0) {
+        fprintf(stderr, "Unsupported block size %d.\n", blockSize);
+        return NULL;
+    }
+
+    // A mapped disk already sits in the kernel's page cache, caching it again would only copy it twice.
+    if (cache_init(SFS_DATA->backend == DISK_MMAP ? 0 : SFS_DATA->cachesize) < 0) {
+        fprintf(stderr, "Could not allocate block cache.\n");
+        return NULL;
+    }
+
+    if (readahead_start() < 0) {
+        fprintf(stderr, "Could not start read-ahead, reading on demand only.\n");
+    }
+
     char buffer[BLOCK_SIZE];
     memset(buffer, 0, BLOCK_SIZE);
 
@@ -62,111 +105,96 @@ void *sfs_init(struct fuse_conn_info *conn) {
         return NULL;
     }
 
-    superBlock->iNodeBitMap = bitmap_allocate(NUM_INODE_BLOCKS);
+    // The i-node bit map starts out over one chunk and grows along with the table.
+    superBlock->iNodeBitMap = bitmap_allocate(INODES_PER_CHUNK);
     if (!superBlock->iNodeBitMap) {
         fprintf(stderr, "Could not allocate block bit map.\n");
         return NULL;
     }
 
-    if (block_read(SUPER_BLOCK_INDEX, buffer) <= 0) { // read super block, if empty create it.
+    if (itable_init() < 0) {
+        fprintf(stderr, "Could not allocate the i-node chunk index.\n");
+        return NULL;
+    }
+
+    // Only the bit map blocks that change get written back, a fresh disk needs all of them written once.
+    if (bitmap_track_dirty(superBlock->blockBitMap, BITMAP_WORDS_PER_BLOCK, !formatted) < 0
+        || bitmap_track_dirty(superBlock->iNodeBitMap, BITMAP_WORDS_PER_BLOCK, !formatted) < 0) {
+        fprintf(stderr, "Could not allocate bit map dirty flags.\n");
+        return NULL;
+    }
+
+    if (!formatted) { // read super block, if empty create it.
         superBlock->numFreeBlocks = NUM_DATA_BLOCKS;
-        superBlock->numFreeINodes = NUM_INODE_BLOCKS;
+        superBlock->numFreeINodes = 0; // The first chunk of the table is added once the data blocks are set up.
     } else {
-        ByteBuffer *byteBuffer = allocate((Byte *) buffer, BLOCK_SIZE, BLOCK_SIZE);
-        if (!byteBuffer) {
-            fprintf(stderr, "Could not allocate byte buffer.\n");
+        int numBlocks = NUM_SUPER_BLOCKS + NUM_BITMAP_BLOCKS;
+        Byte *superBuffer = (Byte *) malloc((size_t) numBlocks * BLOCK_SIZE);
+        int *superBlocks = (int *) malloc(sizeof(int) * numBlocks);
+        if (!superBuffer || !superBlocks) {
+            fprintf(stderr, "Could not allocate super block buffer.\n");
             return NULL;
         }
 
-        superBlock->numFreeBlocks = readInt(byteBuffer);
-        superBlock->numFreeINodes = readByte(byteBuffer);
-
-        int numPartitions = (int) readInt(byteBuffer);
-        for (; numPartitions >= 0; numPartitions--) {
-            superBlock->blockBitMap->container[numPartitions] = (bitmap_type) readInt(byteBuffer);
+        // The super block and the bit map region behind it are read in one go.
+        int index = 0;
+        for (; index < numBlocks; index++) {
+            superBlocks[index] = SUPER_BLOCK_INDEX + index;
         }
 
-        numPartitions = (int) readInt(byteBuffer);
-        for (; numPartitions >= 0; numPartitions--) {
-            superBlock->iNodeBitMap->container[numPartitions] = (bitmap_type) readInt(byteBuffer);
+        if (block_readv(superBlocks, numBlocks, superBuffer, NULL) < 0 || load_super(superBuffer) < 0) {
+            fprintf(stderr, "Could not load super block.\n");
+            return NULL;
         }
 
-        free(byteBuffer->buffer);
-        free(byteBuffer);
+        free(superBuffer);
+        free(superBlocks);
     }
 
-    iNodeList = (INode *) malloc(sizeof(INode) * NUM_INODE_BLOCKS);
-    if (!iNodeList) {
-        fprintf(stderr, "Could not malloc i-node list.\n");
+    if (groups_init(superBlock->blockBitMap, DATA_BLOCK_START, SFS_DATA->freetree) < 0) {
+        fprintf(stderr, "Could not split the data blocks into allocation groups.\n");
         return NULL;
     }
 
-    ino_t node_id = ROOT_INODE_ID;
-    for (; node_id < NUM_INODE_BLOCKS; node_id++) { // TODO check if it's already in file system
-        INode *node = iNodeList + node_id;
-
-        memset(buffer, 0, BLOCK_SIZE);
-        if (block_read((const int) (node_id + INODE_BLOCK_START), buffer) <= 0) {
-            _Bool root = node_id == ROOT_INODE_ID;
-
-            node_stat(node, node_id, (mode_t) ((root ? S_IFDIR : S_IFREG) | S_IRWXU),
-                      (nlink_t) (root ? 2 : DEFAULT_NUM_DIRECTORIES));
-
-            if (root) {
-                node_reserve(node);
-
-                ReserveBlock reserveBlock = block_reserve(node);
-
-                fprintf(stderr, "Reserve block status: [free block: %d] [free link: %d]\n", reserveBlock.nextDataBlock,
-                        reserveBlock.nextLink);
+    if (SFS_DATA->checkinterval > 0 && check_start(SFS_DATA->checkinterval) < 0) {
+        fprintf(stderr, "Could not start the background counter check.\n");
+    }
 
-                if (flush_super() < 0) {
-                    fprintf(stderr, "Could not flush super block.\n");
-                    return NULL;
-                }
-            }
+    links_set_mode(SFS_DATA->indirect);
 
-            if (flush_iNode(node) < 0) {
-                fprintf(stderr, "Could not flush i-node in init.\n");
-                return NULL;
-            }
-        } else {
-            ByteBuffer *byteBuffer = allocate((Byte *) buffer, BLOCK_SIZE, BLOCK_SIZE);
-            if (!byteBuffer) {
-                return NULL;
-            }
+    if (itable_chunks() == 0 && node_table_grow() < 0) {
+        fprintf(stderr, "Could not allocate the first i-node chunk.\n");
+        return NULL;
+    }
 
-            node->id = (ino_t) readLong(byteBuffer);
-            node->userId = (uid_t) readInt(byteBuffer);
-            node->groupId = (gid_t) readInt(byteBuffer);
+    // Only the root is read now, every other i-node is faulted in the first time it's looked up.
+    INode *rootINode = node_get(ROOT_INODE_ID);
+    if (!rootINode) {
+        fprintf(stderr, "Could not load the root i-node.\n");
+        return NULL;
+    }
 
-            node->st_mode = (mode_t) readInt(byteBuffer);
+    node_lock(rootINode);
+    if (!isReservedNode(rootINode)) {
+        node_stat(rootINode, ROOT_INODE_ID, S_IFDIR | S_IRWXU, 2);
+        node_reserve(rootINode);
 
-            node->lastFileModTime.tv_sec = readLong(byteBuffer);
-            node->lastAccessTime.tv_sec = readLong(byteBuffer);
-            node->lastModifiedTime.tv_sec = readLong(byteBuffer);
+        ReserveBlock reserveBlock = block_reserve(rootINode);
 
-            node->numFileLinks = (nlink_t) readLong(byteBuffer);
-            node->fileSize = (size_t) readLong(byteBuffer);
+        fprintf(stderr, "Reserve block status: [free block: %d] [free link: %d]\n", reserveBlock.nextDataBlock,
+                reserveBlock.nextLink);
 
-            int index = 0;
-            int numBlockLinks = sizeof(node->blockLinks) / sizeof(short);
-            for (; index < numBlockLinks; index++) {
-                node->blockLinks[index] = readShort(byteBuffer);
-            }
-
-            free(byteBuffer);
+        if (flush_iNode(rootINode) < 0 || flush_super() < 0) {
+            fprintf(stderr, "Could not flush the root i-node.\n");
+            node_unlock(rootINode);
+            return NULL;
         }
     }
+    node_unlock(rootINode);
 
     memset(buffer, 0, BLOCK_SIZE);
 
-    INode *rootINode = iNodeList + ROOT_INODE_ID;
-    if (!rootINode) {
-        return NULL;
-    }
-
-    if (block_read(rootINode->blockLinks[0], buffer) <= 0) { //TODO maybe remove this boilerplate code.
+    if (block_read(link_block(rootINode, DIRECTORY_LINK), buffer) <= 0) { //TODO maybe remove this boilerplate code.
         rootDirectory = directory_allocate(rootINode->id, "/");
         if (!rootDirectory) {
             fprintf(stderr, "Could not allocate root directory.\n");
@@ -175,17 +203,23 @@ void *sfs_init(struct fuse_conn_info *conn) {
 
         saveDirectory(rootDirectory);
     } else {
-        rootDirectory = malloc(sizeof(Directory));
+        rootDirectory = directory_allocate(rootINode->id, "/");
         if (!rootDirectory) {
             fprintf(stderr, "Could not allocate root directory.\n");
             return NULL;
         }
 
-        rootDirectory->entry = NULL;
-        rootDirectory->sibling = NULL;
-        rootDirectory->child = NULL;
+        // Only the root's entry is read now, the rest of the tree is read as lookups reach it.
+        rootDirectory->loaded = false;
+        if (directory_load(rootDirectory) < 0) {
+            fprintf(stderr, "Could not load the root directory.\n");
+        }
+    }
+
+    node_put(rootINode);
 
-        parseDirectory((void *(*)(Directory *, void *)) loadDirectory, rootDirectory, NULL);
+    if (SFS_DATA->writebackinterval > 0 && itable_writeback_start(SFS_DATA->writebackinterval) < 0) {
+        fprintf(stderr, "Could not start the i-node write back.\n");
     }
 
     pthread_mutex_unlock(&init_mutex);
@@ -202,6 +236,80 @@ void *sfs_init(struct fuse_conn_info *conn) {
  */
 void sfs_destroy(void *userdata) {
     log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+
+    itable_writeback_stop();
+    check_stop(); // Stopped first, so a repair can't change the counts behind the last super block write.
+
+    if (delalloc_flush_all() < 0) {
+        fprintf(stderr, "Could not write back delayed blocks.\n");
+    }
+
+    if (itable_writeback() < 0) {
+        fprintf(stderr, "Could not write back the dirty i-nodes.\n");
+    }
+
+    if (indirect_cache_reset() < 0) {
+        fprintf(stderr, "Could not write back the indirect blocks.\n");
+    }
+
+    if (flush_super() < 0) {
+        fprintf(stderr, "Could not write back the super block and bit maps.\n");
+    }
+
+    if (block_flush() < 0 || disk_sync() < 0) {
+        fprintf(stderr, "Could not write back the block cache.\n");
+    }
+
+    readahead_stop();
+
+    CacheStats stats;
+    cache_stats(&stats);
+    log_msg("    cache: frames=%d hits=%lu misses=%lu evictions=%lu writebacks=%lu prefetches=%lu\n",
+            stats.numFrames, stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.prefetches);
+    log_msg("    flush: sweeps=%lu merges=%lu last=%d\n", stats.flushes, stats.merges, stats.lastMerges);
+
+    groups_destroy();
+
+    cache_destroy();
+    disk_close();
+}
+
+/** Get file system statistics
+ *
+ * The 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
+ *
+ * Answered from the free counts alone, the allocation groups hold the block count in shards so it stays exact while
+ * they allocate in parallel. Blocks promised to delayed writes already count as used.
+ */
+int sfs_statfs(const char *path, struct statvfs *statv) {
+    log_msg("\nsfs_statfs(path=\"%s\", statv=0x%08x)\n", path, statv);
+
+    memset(statv, 0, sizeof(struct statvfs));
+
+    long freeBlocks = groups_free_blocks() - delalloc_blocks();
+    if (freeBlocks < 0) {
+        freeBlocks = 0;
+    }
+
+    // The table can still grow by a chunk for every run of free blocks, up to what the super block can index.
+    long growChunks = MAX_INODE_CHUNKS - itable_chunks();
+    if (growChunks > freeBlocks / INODE_CHUNK_BLOCKS) {
+        growChunks = freeBlocks / INODE_CHUNK_BLOCKS;
+    }
+
+    long freeNodes = __atomic_load_n(&superBlock->numFreeINodes, __ATOMIC_RELAXED) + growChunks * INODES_PER_CHUNK;
+
+    statv->f_bsize = (unsigned long) BLOCK_SIZE;
+    statv->f_frsize = (unsigned long) BLOCK_SIZE;
+    statv->f_blocks = (fsblkcnt_t) NUM_DATA_BLOCKS;
+    statv->f_bfree = (fsblkcnt_t) freeBlocks;
+    statv->f_bavail = (fsblkcnt_t) freeBlocks;
+    statv->f_files = (fsfilcnt_t) (itable_count() + growChunks * INODES_PER_CHUNK);
+    statv->f_ffree = (fsfilcnt_t) freeNodes;
+    statv->f_favail = (fsfilcnt_t) freeNodes;
+    statv->f_namemax = NAME_MAX;
+
+    return 0;
 }
 
 /** Get file attributes.
@@ -217,6 +325,8 @@ int sfs_getattr(const char *path, struct stat *st) {
 
     INode *node = findINode(path);
     if (node) {
+        node_lock(node);
+
         st->st_uid = node->userId;
         st->st_gid = node->groupId;
 
@@ -232,6 +342,9 @@ int sfs_getattr(const char *path, struct stat *st) {
             st->st_size = node->fileSize;
             st->st_blksize = BLOCK_SIZE;
         }
+
+        node_unlock(node);
+        node_put(node);
     } else {
         /*st->st_uid = getuid();
         st->st_gid = getgid();
@@ -292,13 +405,36 @@ int sfs_create(const char *absolutePath, mode_t mode, struct fuse_file_info *fi)
         return ENOSPC;
     }
 
-    INode *node = iNodeList + ino;
+    INode *node = node_get(ino);
     if (!node) {
         return ENOMSG;
     }
 
+    node_lock(node);
     node_reserve(node); // reserve it's place, do this first to avoid any race issues.
     node_stat(node, ino, mode, 1); // Populate the node with the given data.
+    if (S_ISREG(mode)) {
+        node_inline(node); // Small files never need a data block, without the buffer it simply starts out in blocks.
+    }
+
+    if (block_reserve_link(node, DIRECTORY_LINK) == -1) { // The block that will hold it's directory entry.
+        node_unreserve(node);
+        node_unlock(node);
+        node_put(node);
+        return ENOSPC;
+    }
+
+    // A new i-node goes out right away, along with the bit maps that hand it and it's block out.
+    int flushed = flush_iNode(node) < 0 || flush_super() < 0 ? -1 : 0;
+    if (flushed < 0) {
+        node_discard(node); // No directory entry will point at it.
+    }
+    node_unlock(node);
+    node_put(node);
+
+    if (flushed < 0) {
+        return -EIO;
+    }
 
     Directory *nextDirectory = directory_allocate(ino, absoluteToEntry(absolutePath));
     if (!nextDirectory) {
@@ -315,6 +451,8 @@ int sfs_create(const char *absolutePath, mode_t mode, struct fuse_file_info *fi)
     }
 
     saveDirectory(nextDirectory);
+
+    fi->fh = (uint64_t) (uintptr_t) readahead_allocate();
     return retstat;
 }
 
@@ -329,16 +467,21 @@ int sfs_unlink(const char *absolutePath) {
         return 0;
     }
 
-    INode *node = iNodeList + directory->entry->ino;
+    INode *node = node_get(directory->entry->ino);
     if (!node) {
         return ENOMSG;
     }
 
     if (S_ISDIR(node->st_mode)) {
+        node_put(node);
         return EISDIR; // Return if it's removing a directory!
     }
 
+    node_lock(node);
+    delalloc_drop(node); // Whatever it never wrote back never needs a block.
     node_destroy(node);
+    node_unlock(node);
+    node_put(node);
     return retstat;
 }
 
@@ -365,14 +508,18 @@ int sfs_open(const char *path, struct fuse_file_info *fi) {
         return -ENOENT;
     }
 
-    if (S_ISDIR(node->st_mode)) {
+    mode_t mode = node->st_mode;
+    node_put(node);
+
+    if (S_ISDIR(mode)) {
         return EISDIR;
     }
 
-    if ((node->st_mode & S_IXUSR) == 0) {
+    if ((mode & S_IXUSR) == 0) {
         return EACCES;
     }
 
+    fi->fh = (uint64_t) (uintptr_t) readahead_allocate(); // Without it reads are simply never prefetched.
     return retstat;
 }
 
@@ -395,11 +542,108 @@ int sfs_release(const char *path, struct fuse_file_info *fi) {
     log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
             path, fi);
 
+    free((ReadAhead *) (uintptr_t) fi->fh);
+    fi->fh = 0;
+
     // Turn i-node into default empty state using node-stat w/ default params in sfs_init
     // unreserve the i-node
     return retstat;
 }
 
+/**
+ * Reads from a held and locked i-node for sfs_read.
+ */
+static int read_node(INode *node, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    if ((size_t) offset >= node->fileSize || size == 0) {
+        return 0;
+    }
+
+    if ((size_t) offset + size > node->fileSize) {
+        size = node->fileSize - (size_t) offset;
+    }
+
+    if (node->inlineData) {
+        memcpy(buf, node->inlineData + offset, size);
+
+        node->lastAccessTime.tv_sec = time(NULL);
+        return (int) size;
+    }
+
+    int firstLink = (int) (FIRST_DATA_LINK + offset / BLOCK_SIZE);
+    int lastLink = (int) (FIRST_DATA_LINK + (offset + size - 1) / BLOCK_SIZE);
+
+    // Holes read back as zeroes and mapped blocks are copied in place, everything else is read in one batch.
+    int blocks[lastLink - firstLink + 1];
+    int pendingLinks[lastLink - firstLink + 1];
+    int numPending = 0;
+    Byte pendingBlock[BLOCK_SIZE];
+
+    int link = firstLink;
+    for (; link <= lastLink; link++) {
+        off_t blockStart = (off_t) (link - FIRST_DATA_LINK) * BLOCK_SIZE;
+        off_t start = blockStart > offset ? blockStart : offset;
+        off_t end = blockStart + BLOCK_SIZE < offset + (off_t) size ? blockStart + BLOCK_SIZE : offset + (off_t) size;
+
+        int block = link_block(node, link);
+        if (block != -1 && link_unwritten(node, link)) {
+            memset(buf + (start - offset), 0, (size_t) (end - start)); // Preallocated, nothing to read yet.
+            continue;
+        }
+
+        if (block == -1) {
+            // Either a hole or a block still waiting for write back.
+            if (delalloc_load(node, link, pendingBlock)) {
+                memcpy(buf + (start - offset), pendingBlock + (start - blockStart), (size_t) (end - start));
+            } else {
+                memset(buf + (start - offset), 0, (size_t) (end - start));
+            }
+            continue;
+        }
+
+        const Byte *mapped = (const Byte *) block_pointer(block);
+        if (mapped) {
+            memcpy(buf + (start - offset), mapped + (start - blockStart), (size_t) (end - start));
+            continue;
+        }
+
+        pendingLinks[numPending] = link;
+        blocks[numPending++] = block;
+    }
+
+    if (numPending > 0) {
+        Byte *gathered = (Byte *) malloc((size_t) numPending * BLOCK_SIZE);
+        if (!gathered) {
+            return -ENOMEM;
+        }
+
+        if (block_readv(blocks, numPending, gathered, NULL) < 0) {
+            free(gathered);
+            return -EIO;
+        }
+
+        int pending = 0;
+        for (; pending < numPending; pending++) {
+            off_t blockStart = (off_t) (pendingLinks[pending] - FIRST_DATA_LINK) * BLOCK_SIZE;
+            off_t start = blockStart > offset ? blockStart : offset;
+            off_t end = blockStart + BLOCK_SIZE < offset + (off_t) size ? blockStart + BLOCK_SIZE : offset + (off_t) size;
+
+            memcpy(buf + (start - offset), gathered + (size_t) pending * BLOCK_SIZE + (start - blockStart),
+                   (size_t) (end - start));
+        }
+
+        free(gathered);
+    }
+
+    readahead_update((ReadAhead *) (uintptr_t) fi->fh, node, firstLink, lastLink);
+
+    node->lastAccessTime.tv_sec = time(NULL);
+    return (int) size;
+}
+
 /** Read data from an open file
  *
  * Read should return exactly the number of bytes requested except
@@ -421,18 +665,150 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
         return -ENOENT;
     }
 
-    int nextDataBlock = nextFreeDataBlock();
-    if (nextDataBlock == -1) {
-        return -1;
+    node_lock(node);
+    retstat = read_node(node, buf, size, offset, fi);
+    node_unlock(node);
+    node_put(node);
+
+    return retstat;
+}
+
+/**
+ * Moves an inline file's data out to it's first data link once it outgrows the i-node block. The data waits there as
+ * a pending block like any other write.
+ * @return 0 on success, the negated error otherwise.
+ */
+static int promote_inline(INode *node) {
+    if (node->fileSize > 0) {
+        Byte block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        memcpy(block, node->inlineData, node->fileSize);
+
+        int stored = delalloc_store(node, FIRST_DATA_LINK, block);
+        if (stored < 0) {
+            return stored;
+        }
     }
 
-    block_reserve(node);
+    free(node->inlineData);
+    node->inlineData = NULL;
+    return 0;
+}
 
-    if (block_read(nextDataBlock, buf) <= 0) {
-        return -1;
+/**
+ * Writes to a held and locked i-node for sfs_write.
+ */
+static int write_node(INode *node, const char *buf, size_t size, off_t offset) {
+    if (size == 0) {
+        return 0;
     }
 
-    return retstat;
+    int firstLink = (int) (FIRST_DATA_LINK + offset / BLOCK_SIZE);
+    int lastLink = (int) (FIRST_DATA_LINK + (offset + size - 1) / BLOCK_SIZE);
+    int numLinks = lastLink - firstLink + 1;
+    if (lastLink >= links_max(node)) {
+        return -EFBIG;
+    }
+
+    // A small file is written straight into it's i-node block, a single write and no data block.
+    if (node->inlineData && offset + size <= INLINE_DATA_BYTES) {
+        memcpy(node->inlineData + offset, buf, size);
+        if (offset + size > node->fileSize) {
+            node->fileSize = offset + size;
+        }
+
+        node->lastModifiedTime.tv_sec = time(NULL);
+        node->lastFileModTime.tv_sec = time(NULL);
+
+        node_dirty(node);
+        return (int) size;
+    }
+
+    if (node->inlineData) {
+        int promoted = promote_inline(node);
+        if (promoted < 0) {
+            return promoted;
+        }
+    }
+
+    int blocks[numLinks];
+    Byte *buffer = (Byte *) calloc((size_t) numLinks, BLOCK_SIZE);
+    if (!buffer) {
+        return -ENOMEM;
+    }
+
+    // Partially written blocks at either end keep the bytes we aren't overwriting.
+    size_t head = (size_t) (offset % BLOCK_SIZE);
+    size_t tail = (size_t) ((offset + size) % BLOCK_SIZE);
+
+    int numPartial = 0;
+    int partialLinks[2];
+    if (head != 0) {
+        partialLinks[numPartial++] = 0;
+    }
+    if (tail != 0 && (lastLink != firstLink || numPartial == 0)) {
+        partialLinks[numPartial++] = lastLink - firstLink;
+    }
+
+    int partial = 0;
+    for (; partial < numPartial; partial++) {
+        int link = firstLink + partialLinks[partial];
+        Byte *block = buffer + (size_t) partialLinks[partial] * BLOCK_SIZE;
+
+        if (delalloc_load(node, link, block) || link_block(node, link) == -1 || link_unwritten(node, link)) {
+            continue;
+        }
+
+        if (block_read(link_block(node, link), block) < 0) {
+            free(buffer);
+            return -EIO;
+        }
+    }
+
+    memcpy(buffer + head, buf, size);
+
+    // Links that already have a block are written in place, the rest wait for write back to be given blocks.
+    int numBlocks = 0;
+    int link = firstLink;
+    for (; link <= lastLink; link++) {
+        Byte *block = buffer + (size_t) (link - firstLink) * BLOCK_SIZE;
+
+        int mapped = link_block(node, link);
+        if (mapped != -1) {
+            // The first write converts a preallocated block, splitting it out of it's unwritten extent.
+            if (link_set_unwritten(node, link, false) < 0) {
+                free(buffer);
+                return -ENOSPC; // The map had no room left for the split.
+            }
+
+            memmove(buffer + (size_t) numBlocks * BLOCK_SIZE, block, BLOCK_SIZE);
+            blocks[numBlocks++] = mapped;
+            continue;
+        }
+
+        int stored = delalloc_store(node, link, block);
+        if (stored < 0) {
+            free(buffer);
+            return stored;
+        }
+    }
+
+    if (numBlocks > 0 && block_writev(blocks, numBlocks, buffer, NULL) < 0) {
+        free(buffer);
+        return -EIO;
+    }
+
+    free(buffer);
+
+    if (offset + size > node->fileSize) {
+        node->fileSize = offset + size;
+    }
+
+    node->lastModifiedTime.tv_sec = time(NULL);
+    node->lastFileModTime.tv_sec = time(NULL);
+
+    node_dirty(node);
+    return (int) size;
 }
 
 /** Write data to an open file
@@ -454,20 +830,160 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
         return -ENOENT;
     }
 
-    int nextDataBlock = nextFreeDataBlock();
-    if (nextDataBlock == -1) {
-        return -1;
+    node_lock(node);
+    retstat = write_node(node, buf, size, offset);
+    node_unlock(node);
+    node_put(node);
+
+    if (retstat < 0) {
+        return retstat;
     }
 
-    block_reserve(node);
+    // Writing back takes other i-nodes' locks, so it waits until this one's is let go.
+    if (itable_balance_dirty() < 0) {
+        return -EIO;
+    }
 
-    if (block_write(nextDataBlock, buf) <= 0) {
-        return -1;
+    if ((size_t) delalloc_blocks() * BLOCK_SIZE > DELALLOC_MAX_BYTES) {
+        int flushed = delalloc_flush_all();
+        if (flushed < 0) {
+            return flushed;
+        }
+    }
+
+    return retstat;
+}
+
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
+
+    INode *node = findINode(path);
+    int flushed = 0;
+    if (node) {
+        node_lock(node);
+        flushed = delalloc_flush(node);
+        node_unlock(node);
+        node_put(node);
+    }
+
+    if (flushed < 0) {
+        return flushed;
+    }
+
+    if (itable_writeback() < 0) {
+        return -EIO;
+    }
+
+    if (block_flush() < 0 || disk_sync() < 0) {
+        return -EIO;
+    }
+
+    CacheStats stats;
+    cache_stats(&stats);
+    log_msg("    flush: merges=%d\n", stats.lastMerges);
+
+    return 0;
+}
+
+
+/**
+ * Preallocates the range of a held and locked i-node for sfs_fallocate.
+ */
+static int fallocate_node(INode *node, int mode, off_t offset, off_t length) {
+    if (S_ISDIR(node->st_mode)) {
+        return -EISDIR;
+    }
+
+    int firstLink = (int) (FIRST_DATA_LINK + offset / BLOCK_SIZE);
+    int lastLink = (int) (FIRST_DATA_LINK + (offset + length - 1) / BLOCK_SIZE);
+    if (lastLink >= links_max(node)) {
+        return -EFBIG;
+    }
+
+    // Preallocated blocks only make sense out of line, so inline data moves out first.
+    if (node->inlineData) {
+        int promoted = promote_inline(node);
+        if (promoted < 0) {
+            return promoted;
+        }
+    }
+
+    // Pending writes get their blocks first, the range left unlinked is what needs preallocating.
+    int flushed = delalloc_flush(node);
+    if (flushed < 0) {
+        return flushed;
+    }
+
+    int numNeeded = 0;
+
+    int link = firstLink;
+    for (; link <= lastLink; link++) {
+        numNeeded += link_block(node, link) == -1;
+    }
+
+    // Blocks promised to other files' pending writes aren't free to take.
+    if (numNeeded > groups_free_blocks() - delalloc_blocks()) {
+        return -ENOSPC;
+    }
+
+    int retstat = 0;
+    if (block_reserve_links(node, firstLink, lastLink - firstLink + 1, true) == -1) {
+        retstat = -ENOSPC; // Keep whatever was reserved, like a partial fallocate on a full disk.
+    }
+
+    if (retstat == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && (size_t) (offset + length) > node->fileSize) {
+        node->fileSize = (size_t) (offset + length);
+    }
+
+    node->lastModifiedTime.tv_sec = time(NULL);
+
+    if (flush_iNode(node) < 0 || flush_super() < 0) {
+        return -EIO;
     }
 
     return retstat;
 }
 
+/**
+ * Allocates space for a file
+ *
+ * Reserves contiguous blocks for every unlinked block in the range and marks them unwritten, so they read back as
+ * zeroes until the first write. The file grows to cover the range unless FALLOC_FL_KEEP_SIZE is given.
+ *
+ * Introduced in version 2.9.1
+ */
+int sfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    log_msg("\nsfs_fallocate(path=\"%s\", mode=%d, offset=%lld, length=%lld, fi=0x%08x)\n",
+            path, mode, offset, length, fi);
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+
+    INode *node = findINode(path);
+    if (!node) {
+        return -ENOENT;
+    }
+
+    node_lock(node);
+    int retstat = fallocate_node(node, mode, offset, length);
+    node_unlock(node);
+    node_put(node);
+
+    return retstat;
+}
 
 /** Create a directory */
 int sfs_mkdir(const char *absolutePath, mode_t mode) {
@@ -491,14 +1007,34 @@ int sfs_mkdir(const char *absolutePath, mode_t mode) {
         return ENOSPC;
     }
 
-    INode *node = iNodeList + ino;
+    INode *node = node_get(ino);
     if (!node) {
         return ENOMSG;
     }
 
+    node_lock(node);
     node_reserve(node); // reserve it's place, do this first to avoid any race issues.
     node_stat(node, ino, mode, 2); // Populate the node with the given data.
 
+    if (block_reserve_link(node, DIRECTORY_LINK) == -1) { // The block that will hold it's directory entry.
+        node_unreserve(node);
+        node_unlock(node);
+        node_put(node);
+        return ENOSPC;
+    }
+
+    // A new i-node goes out right away, along with the bit maps that hand it and it's block out.
+    int flushed = flush_iNode(node) < 0 || flush_super() < 0 ? -1 : 0;
+    if (flushed < 0) {
+        node_discard(node); // No directory entry will point at it.
+    }
+    node_unlock(node);
+    node_put(node);
+
+    if (flushed < 0) {
+        return -EIO;
+    }
+
     Directory *nextDirectory = directory_allocate(ino, absoluteToEntry(absolutePath));
     if (!nextDirectory) {
         return ENOMSG;
@@ -513,6 +1049,8 @@ int sfs_mkdir(const char *absolutePath, mode_t mode) {
         saveDirectory(lastDirectory);
     }
 
+    saveDirectory(nextDirectory);
+
     return retstat;
 }
 
@@ -528,16 +1066,20 @@ int sfs_rmdir(const char *path) {
         return 0;
     }
 
-    INode *node = iNodeList + directory->entry->ino;
+    INode *node = node_get(directory->entry->ino);
     if (!node) {
         return ENOMSG;
     }
 
     if (S_ISREG(node->st_mode)) {
+        node_put(node);
         return ENOTDIR; // Return if it's removing a directory!
     }
 
+    node_lock(node);
     node_destroy(node);
+    node_unlock(node);
+    node_put(node);
     return retstat;
 }
 
@@ -559,11 +1101,14 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi) {
         return 0;
     }
 
-    if (S_ISREG(node->st_mode)) {
+    mode_t mode = node->st_mode;
+    node_put(node);
+
+    if (S_ISREG(mode)) {
         return EISDIR;
     }
 
-    if ((node->st_mode & S_IXUSR) == 0) {
+    if ((mode & S_IXUSR) == 0) {
         return EACCES;
     }
 
@@ -602,7 +1147,7 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
     }
 
     Directory *directory = parent->child;
-    while (directory) {
+    while (directory && directory_load(directory) == 0) {
         fprintf(stderr, "Entry name: %s\n", directory->entry->entryName);
         filler(buf, directory->entry->entryName, NULL, 0);
 
@@ -628,12 +1173,15 @@ struct fuse_operations sfs_oper = {
         .destroy = sfs_destroy,
 
         .getattr = sfs_getattr,
+        .statfs = sfs_statfs,
         .create = sfs_create,
         .unlink = sfs_unlink,
         .open = sfs_open,
         .release = sfs_release,
         .read = sfs_read,
         .write = sfs_write,
+        .fsync = sfs_fsync,
+        .fallocate = sfs_fallocate,
 
         .rmdir = sfs_rmdir,
         .mkdir = sfs_mkdir,
@@ -643,11 +1191,161 @@ struct fuse_operations sfs_oper = {
         .releasedir = sfs_releasedir
 };
 
+enum {
+    KEY_CACHE_SIZE,
+    KEY_BLOCK_SIZE,
+    KEY_BACKEND_SYNC,
+    KEY_BACKEND_URING,
+    KEY_BACKEND_MMAP,
+    KEY_ODIRECT,
+    KEY_FREE_TREE,
+    KEY_CHECK_INTERVAL,
+    KEY_WRITEBACK_INTERVAL,
+    KEY_INDIRECT,
+    KEY_EXTENT,
+};
+
+static struct fuse_opt sfs_opts[] = {
+        FUSE_OPT_KEY("cache_size=", KEY_CACHE_SIZE),
+        FUSE_OPT_KEY("blocksize=", KEY_BLOCK_SIZE),
+        FUSE_OPT_KEY("backend=sync", KEY_BACKEND_SYNC),
+        FUSE_OPT_KEY("backend=uring", KEY_BACKEND_URING),
+        FUSE_OPT_KEY("backend=mmap", KEY_BACKEND_MMAP),
+        FUSE_OPT_KEY("odirect", KEY_ODIRECT),
+        FUSE_OPT_KEY("freetree", KEY_FREE_TREE),
+        FUSE_OPT_KEY("check_interval=", KEY_CHECK_INTERVAL),
+        FUSE_OPT_KEY("writeback_interval=", KEY_WRITEBACK_INTERVAL),
+        FUSE_OPT_KEY("blockmap=extent", KEY_EXTENT),
+        FUSE_OPT_KEY("blockmap=indirect", KEY_INDIRECT),
+        FUSE_OPT_END
+};
+
 void sfs_usage() {
     fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "sfs options:\n");
+    fprintf(stderr, "    -o cache_size=N[K|M|G]      memory budget of the block cache, 0 disables it (default %d)\n",
+            DEFAULT_CACHE_BYTES);
+    fprintf(stderr, "    -o blocksize=N[K]           block size of a disk being formatted, %d to %d (default %d)\n",
+            MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+    fprintf(stderr, "    -o backend=sync|uring|mmap  pread/pwrite, batched io_uring submissions, or a shared mapping of\n");
+    fprintf(stderr, "                                the disk that replaces the block cache (default sync)\n");
+    fprintf(stderr, "    -o odirect                  open the disk with O_DIRECT so only the block cache holds it\n");
+    fprintf(stderr, "    -o freetree                 also index free space as extent trees, for best-fit allocation\n");
+    fprintf(stderr, "    -o check_interval=N         recount the bit maps every N seconds in the background and repair\n");
+    fprintf(stderr, "                                the free counts if they drifted, 0 never does (default 0)\n");
+    fprintf(stderr, "    -o writeback_interval=N     write changed i-nodes back every N seconds, 0 only once too many\n");
+    fprintf(stderr, "                                are dirty, on fsync and at unmount (default %d)\n",
+            DEFAULT_WRITEBACK_INTERVAL);
+    fprintf(stderr, "    -o blockmap=extent|indirect map the links of new files as extents, or by direct pointers and\n");
+    fprintf(stderr, "                                single, double and triple indirect blocks (default extent)\n");
     abort();
 }
 
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ * @return The number of bytes, or -1 if it's malformed or doesn't fit in a long.
+ */
+static long parseSize(const char *value) {
+    char *end;
+    errno = 0;
+    long size = strtol(value, &end, 10);
+    if (end == value || size < 0 || errno == ERANGE) {
+        return -1;
+    }
+
+    int shift = 0;
+    switch (toupper(*end)) {
+        case 'G':
+            shift += 10; // fall through
+        case 'M':
+            shift += 10; // fall through
+        case 'K':
+            shift += 10;
+            end++; // fall through
+        default:
+            break;
+    }
+
+    if (*end != '\0' || size > (LONG_MAX >> shift)) {
+        return -1;
+    }
+
+    return size << shift;
+}
+
+static int sfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    (void) outargs;
+    struct sfs_state *sfs_data = data;
+
+    switch (key) {
+        case KEY_CACHE_SIZE: {
+            long size = parseSize(strchr(arg, '=') + 1);
+            if (size < 0) {
+                fprintf(stderr, "bad cache_size: %s\n", arg);
+                return -1;
+            }
+
+            sfs_data->cachesize = (size_t) size;
+            return 0;
+        }
+        case KEY_BLOCK_SIZE: {
+            long size = parseSize(strchr(arg, '=') + 1);
+            if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+                fprintf(stderr, "bad blocksize: %s\n", arg);
+                return -1;
+            }
+
+            sfs_data->blocksize = (int) size;
+            return 0;
+        }
+        case KEY_BACKEND_SYNC:
+            sfs_data->backend = DISK_SYNC;
+            return 0;
+        case KEY_BACKEND_URING:
+            sfs_data->backend = DISK_URING;
+            return 0;
+        case KEY_BACKEND_MMAP:
+            sfs_data->backend = DISK_MMAP;
+            return 0;
+        case KEY_ODIRECT:
+            sfs_data->odirect = 1;
+            return 0;
+        case KEY_FREE_TREE:
+            sfs_data->freetree = 1;
+            return 0;
+        case KEY_EXTENT:
+            sfs_data->indirect = 0;
+            return 0;
+        case KEY_INDIRECT:
+            sfs_data->indirect = 1;
+            return 0;
+        case KEY_CHECK_INTERVAL: {
+            char *end;
+            long interval = strtol(strchr(arg, '=') + 1, &end, 10);
+            if (*end != '\0' || interval < 0 || interval > INT_MAX) {
+                fprintf(stderr, "bad check_interval: %s\n", arg);
+                return -1;
+            }
+
+            sfs_data->checkinterval = (int) interval;
+            return 0;
+        }
+        case KEY_WRITEBACK_INTERVAL: {
+            char *end;
+            long interval = strtol(strchr(arg, '=') + 1, &end, 10);
+            if (*end != '\0' || interval < 0 || interval > INT_MAX) {
+                fprintf(stderr, "bad writeback_interval: %s\n", arg);
+                return -1;
+            }
+
+            sfs_data->writebackinterval = (int) interval;
+            return 0;
+        }
+        default:
+            return 1; // Hand everything else to fuse.
+    }
+}
+
 int main(int argc, char *argv[]) {
     int fuse_stat;
     struct sfs_state *sfs_data;
@@ -668,12 +1366,28 @@ int main(int argc, char *argv[]) {
     argv[argc - 1] = NULL;
     argc--;
 
+    // Pull out our own mount options, fuse gets the rest
+    sfs_data->cachesize = DEFAULT_CACHE_BYTES;
+    sfs_data->backend = DISK_SYNC;
+    sfs_data->blocksize = DEFAULT_BLOCK_SIZE;
+    sfs_data->odirect = 0;
+    sfs_data->freetree = 0;
+    sfs_data->checkinterval = 0;
+    sfs_data->writebackinterval = DEFAULT_WRITEBACK_INTERVAL;
+    sfs_data->indirect = 0;
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, sfs_data, sfs_opts, sfs_opt_proc) < 0)
+        sfs_usage();
+
     sfs_data->logfile = log_open();
 
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
 
+    fuse_opt_free_args(&args);
+
     return fuse_stat;
 }
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned numSqes;
+
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+} Ring;
+
+static __thread Ring *threadRing = NULL;
+
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static void ring_close(void *value) {
+    Ring *ring = (Ring *) value;
+    if (!ring) {
+        return;
+    }
+
+    munmap(ring->sqes, ring->numSqes * sizeof(struct io_uring_sqe));
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+
+    close(ring->fd);
+    free(ring);
+}
+
+static void ring_key_create() {
+    pthread_key_create(&ringKey, ring_close);
+}
+
+static Ring *ring_open() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Ring *ring = (Ring *) calloc(1, sizeof(Ring));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd = fd;
+    ring->numSqes = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->cqRing = ring->sqRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(fd);
+            free(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                              IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = (char *) ring->sqRing;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = (char *) ring->cqRing;
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * The calling thread's ring, set up the first time the thread does I/O and torn down when it exits.
+ */
+static Ring *thread_ring() {
+    if (threadRing) {
+        return threadRing;
+    }
+
+    pthread_once(&ringKeyOnce, ring_key_create);
+
+    threadRing = ring_open();
+    if (threadRing) {
+        pthread_setspecific(ringKey, threadRing);
+    }
+
+    return threadRing;
+}
+
+int uring_open() {
+    return thread_ring() ? 0 : -1;
+}
+
+/**
+ * Moves every completion waiting in the ring into it's run.
+ * @return The number of completions reaped.
+ */
+static unsigned ring_reap(Ring *ring, IoRun *runs) {
+    unsigned reaped = 0;
+
+    unsigned head = *ring->cqHead;
+    for (; head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE); head++, reaped++) {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cqMask);
+        runs[cqe->user_data].done = cqe->res;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return reaped;
+}
+
+/**
+ * Waits out the submissions the kernel already took once io_uring_enter failed partway through a batch. They still
+ * point into the caller's buffers, so nothing can be handed back or retried another way until they complete.
+ */
+static void ring_drain(Ring *ring, IoRun *runs, unsigned inFlight) {
+    while (inFlight > 0) {
+        unsigned reaped = ring_reap(ring, runs);
+        inFlight -= reaped < inFlight ? reaped : inFlight;
+        if (inFlight == 0) {
+            break;
+        }
+
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, inFlight, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            && errno != EINTR) {
+            sched_yield(); // Completions land in the ring all the same, keep polling it.
+        }
+    }
+}
+
+int uring_transfer(int fd, IoRun *runs, int numRuns, int write) {
+    Ring *ring = thread_ring();
+    if (!ring) {
+        return -1;
+    }
+
+    int submitted = 0;
+    while (submitted < numRuns) {
+        unsigned batch = (unsigned) (numRuns - submitted);
+        if (batch > ring->numSqes) {
+            batch = ring->numSqes;
+        }
+
+        unsigned tail = *ring->sqTail;
+        unsigned index = 0;
+        for (; index < batch; index++, tail++) {
+            IoRun *run = runs + submitted + index;
+            unsigned slot = tail & *ring->sqMask;
+
+            struct io_uring_sqe *sqe = ring->sqes + slot;
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = (__u8) (write ? IORING_OP_WRITEV : IORING_OP_READV);
+            sqe->fd = fd;
+            sqe->addr = (unsigned long) run->iov;
+            sqe->len = (__u32) run->numIov;
+            sqe->off = (__u64) run->offset;
+            sqe->user_data = (__u64) (submitted + index);
+
+            ring->sqArray[slot] = slot;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit and wait in the same call, the batch is reaped before this thread goes on.
+        unsigned toSubmit = batch;
+        unsigned reaped = 0;
+        while (reaped < batch) {
+            int entered = (int) syscall(__NR_io_uring_enter, ring->fd, toSubmit, batch - reaped,
+                                        IORING_ENTER_GETEVENTS, NULL, 0);
+            if (entered < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    continue;
+                }
+
+                perror("io_uring_enter failed");
+
+                // The entries the kernel never took are withdrawn, the ones it did are waited for, so the caller
+                // can fall back to preadv/pwritev without racing them.
+                __atomic_store_n(ring->sqTail, tail - toSubmit, __ATOMIC_RELEASE);
+                ring_drain(ring, runs, batch - toSubmit - reaped);
+                return -1;
+            }
+            toSubmit -= (unsigned) entered < toSubmit ? (unsigned) entered : toSubmit;
+
+            reaped += ring_reap(ring, runs);
+        }
+
+        submitted += (int) batch;
+    }
+
+    return 0;
+}
+
+#else
+
+int uring_open() {
+    return -1;
+}
+
+int uring_transfer(int fd, IoRun *runs, int numRuns, int write) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef ASSIGNMENT3_URING_H
+#define ASSIGNMENT3_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * The number of submissions each thread's ring can hold at once.
+ */
+#define URING_ENTRIES 64
+
+/**
+ * One preadv/pwritev worth of work: a run of consecutive blocks starting at @offset.
+ */
+typedef struct {
+    off_t offset;
+
+    struct iovec *iov;
+
+    int numIov;
+
+    /**
+     * Bytes moved once the run completes, or a negative errno.
+     */
+    ssize_t done;
+} IoRun;
+
+/**
+ * Sets up a ring for the calling thread to check that the kernel lets us use io_uring.
+ * @return 0 if io_uring is usable, -1 otherwise.
+ */
+int uring_open();
+
+/**
+ * Submits every run against @fd in batches and reaps the completions, filling in each run's @done.
+ * Each thread owns it's own ring so worker threads never wait on each other's I/O. The call is still synchronous:
+ * the calling FUSE worker sleeps in io_uring_enter until every run of a batch completed, because it's caller needs
+ * the data or the written blocks before going on. What it gains over preadv/pwritev is queue depth, not a free worker.
+ * @return 0 once every run completed, -1 if this thread couldn't get a ring or io_uring_enter failed. Nothing is
+ * left in flight on failure, so the runs can be retried another way.
+ */
+int uring_transfer(int fd, IoRun *runs, int numRuns, int write);
+
+#endif //ASSIGNMENT3_URING_H